@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "date.h"
+
+#define DAY 86400
+/* how far from a looked up time a span is searched for transitions */
+#define SPANDAYS 32
+#define NSPANS 16
+
+/*
+ * A span is an interval [start, end) of UTC seconds during which the
+ * local time offset doesn't change.  Trash entries are clustered in time,
+ * so a handful of spans answers almost every lookup without going through
+ * localtime.
+ */
+struct span {
+	time_t start;
+	time_t end;
+	long off;
+};
+
+static struct span spans[NSPANS];
+static int nspans;
+static int nextspan;
+
+
+/* function declarations */
+static long gmtoff(time_t t);
+static long localoff(time_t t);
+static time_t daysfromcivil(long y, int m, int d);
+static void civilfromdays(time_t days, long *y, int *m, int *d);
+static int getdigits(const char *s, int n);
+static int parsedate(const char *str, int f[6]);
+static char *putdigits(char *s, long v, int n);
+
+
+/* function implementations */
+static long
+gmtoff(time_t t)
+{
+	struct tm tm;
+
+	if (!localtime_r(&t, &tm))
+		return 0;
+
+	return tm.tm_gmtoff;
+}
+
+static long
+localoff(time_t t)
+{
+	static int tzinit;
+
+	for (int i = 0; i < nspans; i++)
+		if (spans[i].start <= t && t < spans[i].end)
+			return spans[i].off;
+
+	if (!tzinit) {
+		tzset();
+		tzinit = 1;
+	}
+
+	long off = gmtoff(t);
+	time_t lo = t, hi = t;
+	int i;
+
+	/* walk a day at a time, then bisect the day the offset changed in */
+	for (i = 0; i < SPANDAYS && gmtoff(lo - DAY) == off; i++)
+		lo -= DAY;
+	if (i < SPANDAYS) {
+		time_t a = lo - DAY;
+		while (lo - a > 1) {
+			time_t mid = a + (lo - a) / 2;
+			if (gmtoff(mid) == off)
+				lo = mid;
+			else
+				a = mid;
+		}
+	}
+
+	for (i = 0; i < SPANDAYS && gmtoff(hi + DAY) == off; i++)
+		hi += DAY;
+	if (i < SPANDAYS) {
+		time_t b = hi + DAY;
+		while (b - hi > 1) {
+			time_t mid = hi + (b - hi) / 2;
+			if (gmtoff(mid) == off)
+				hi = mid;
+			else
+				b = mid;
+		}
+	}
+
+	spans[nextspan] = (struct span){ lo, hi + 1, off };
+	nextspan = (nextspan + 1) % NSPANS;
+	if (nspans < NSPANS)
+		nspans++;
+
+	return off;
+}
+
+/* days since 1970-01-01 of the proleptic gregorian date y-m-d */
+static time_t
+daysfromcivil(long y, int m, int d)
+{
+	y -= m <= 2;
+	long era = (y >= 0 ? y : y - 399) / 400;
+	long yoe = y - era * 400;
+	long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return (time_t)era * 146097 + doe - 719468;
+}
+
+static void
+civilfromdays(time_t days, long *y, int *m, int *d)
+{
+	days += 719468;
+	long era = (days >= 0 ? days : days - 146096) / 146097;
+	long doe = days - era * 146097;
+	long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	long mp = (5 * doy + 2) / 153;
+
+	*d = doy - (153 * mp + 2) / 5 + 1;
+	*m = mp < 10 ? mp + 3 : mp - 9;
+	*y = yoe + era * 400 + (*m <= 2);
+}
+
+static int
+getdigits(const char *s, int n)
+{
+	int v = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (s[i] < '0' || s[i] > '9')
+			return -1;
+		v = v * 10 + (s[i] - '0');
+	}
+
+	return v;
+}
+
+static char *
+putdigits(char *s, long v, int n)
+{
+	for (int i = n - 1; i >= 0; i--) {
+		s[i] = '0' + v % 10;
+		v /= 10;
+	}
+
+	return s + n;
+}
+
+/*
+ * Split str in the "YYYY-MM-DDThh:mm:ss" format into year, month, day,
+ * hours, minutes and seconds.  Return -1 if str isn't in that format.
+ */
+static int
+parsedate(const char *str, int f[6])
+{
+	static const char seps[] = "--T::";
+
+	for (int i = 0; i < 6; i++) {
+		int n = i == 0 ? 4 : 2;
+		if ((f[i] = getdigits(str, n)) < 0)
+			return -1;
+		str += n;
+		if (i < 5 && *str++ != seps[i])
+			return -1;
+	}
+
+	if (f[1] < 1 || f[1] > 12 || f[2] < 1 || f[2] > 31 ||
+			f[3] > 23 || f[4] > 59 || f[5] > 60)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Return whether str is a date strtotime() can parse.  Unlike strtotime,
+ * this is safe to call from any thread.
+ */
+int
+isdate(const char *str)
+{
+	int f[6];
+
+	return parsedate(str, f) == 0;
+}
+
+/*
+ * Convert a local time in the "YYYY-MM-DDThh:mm:ss" format used by the
+ * DeletionDate key to a time_t, anything after the seconds is ignored.
+ * Return (time_t)-1 if str isn't in that format.
+ */
+time_t
+strtotime(const char *str)
+{
+	int f[6];
+	if (parsedate(str, f) < 0)
+		return -1;
+
+	time_t local = daysfromcivil(f[0], f[1], f[2]) * DAY
+		+ f[3] * 3600 + f[4] * 60 + f[5];
+
+	/*
+	 * The offsets in effect a day before and after are the only candidates.
+	 * When both are consistent the wall time is ambiguous, take the earlier
+	 * instant.  When neither is, the wall time was skipped by a transition,
+	 * interpret it with the offset from before the transition.
+	 */
+	long before = localoff(local - DAY);
+	long after = localoff(local + DAY);
+	time_t t = local - before;
+	if (localoff(t) != before && localoff(local - after) == after)
+		return local - after;
+
+	return t;
+}
+
+/*
+ * Format time as a local time in the "YYYY-MM-DDThh:mm:ss" format into buf,
+ * which must hold at least DATELEN bytes.  Return buf.
+ */
+char *
+timetostr(time_t time, char *buf)
+{
+	time_t local = time + localoff(time);
+	time_t days = local / DAY;
+	long secs = local % DAY;
+	if (secs < 0) {
+		secs += DAY;
+		days--;
+	}
+
+	long year;
+	int mon, mday;
+	civilfromdays(days, &year, &mon, &mday);
+
+	if (year < 0 || year > 9999) {
+		snprintf(buf, DATELEN, "%04ld-%02d-%02dT%02ld:%02ld:%02ld", year,
+				mon, mday, secs / 3600, secs / 60 % 60, secs % 60);
+		return buf;
+	}
+
+	char *p = buf;
+	p = putdigits(p, year, 4);
+	*p++ = '-';
+	p = putdigits(p, mon, 2);
+	*p++ = '-';
+	p = putdigits(p, mday, 2);
+	*p++ = 'T';
+	p = putdigits(p, secs / 3600, 2);
+	*p++ = ':';
+	p = putdigits(p, secs / 60 % 60, 2);
+	*p++ = ':';
+	p = putdigits(p, secs % 60, 2);
+	*p = '\0';
+
+	return buf;
+}
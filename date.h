@@ -0,0 +1,9 @@
+#ifndef DATE_H
+#define DATE_H
+/* length of "YYYY-MM-DDThh:mm:ss" including the terminating null byte */
+#define DATELEN 20
+
+int isdate(const char *str);
+time_t strtotime(const char *str);
+char *timetostr(time_t time, char *buf);
+#endif
@@ -0,0 +1,134 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "gzip.h"
+#include "hash.h"
+#include "util.h"
+
+#define CHUNK (1 << 17)
+/* a deflate window with a gzip header */
+#define GZIPBITS (15 + 16)
+
+
+/* function declarations */
+static ssize_t readchunk(int fd, unsigned char *buf);
+
+
+/* function implementations */
+static ssize_t
+readchunk(int fd, unsigned char *buf)
+{
+	ssize_t n;
+
+	while ((n = read(fd, buf, CHUNK)) < 0 && errno == EINTR)
+		;
+	if (n < 0)
+		die("read:");
+
+	return n;
+}
+
+/* Return whether the file open on fd starts with the gzip magic number. */
+int
+isgzip(int fd)
+{
+	unsigned char magic[2];
+
+	return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+		magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+/*
+ * Compress everything read from infd to outfd as a gzip stream, a chunk at
+ * a time.  *in and *out are set to the bytes read and written.
+ */
+void
+gzipfd(int infd, int outfd, off_t *in, off_t *out)
+{
+	unsigned char *inbuf = xmalloc(CHUNK);
+	unsigned char *outbuf = xmalloc(CHUNK);
+	z_stream strm = { 0 };
+
+	if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GZIPBITS, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK)
+		die("deflateInit2: cannot initialize zlib");
+
+	*in = *out = 0;
+	int flush;
+	do {
+		ssize_t n = readchunk(infd, inbuf);
+		*in += n;
+		flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+		strm.next_in = inbuf;
+		strm.avail_in = n;
+
+		do {
+			strm.next_out = outbuf;
+			strm.avail_out = CHUNK;
+			deflate(&strm, flush);
+			size_t have = CHUNK - strm.avail_out;
+			if (have && xwrite(outfd, outbuf, have) < 0)
+				die("write:");
+			*out += have;
+		} while (strm.avail_out == 0);
+	} while (flush != Z_FINISH);
+
+	deflateEnd(&strm);
+	free(outbuf);
+	free(inbuf);
+}
+
+/*
+ * Decompress the gzip stream read from infd to outfd a chunk at a time,
+ * the whole of it is never held in memory.  Unless crc is NULL, *crc is
+ * set to the CRC32C of the output.  Return -1 if it's corrupt or cut short.
+ */
+int
+gunzipfd(int infd, int outfd, uint32_t *crc)
+{
+	unsigned char *inbuf = xmalloc(CHUNK);
+	unsigned char *outbuf = xmalloc(CHUNK);
+	z_stream strm = { 0 };
+
+	if (inflateInit2(&strm, GZIPBITS) != Z_OK)
+		die("inflateInit2: cannot initialize zlib");
+
+	if (crc)
+		*crc = 0;
+	int ret = Z_OK;
+	while (ret == Z_OK || ret == Z_BUF_ERROR) {
+		ssize_t n = readchunk(infd, inbuf);
+		if (n == 0) {
+			warn("gunzip: unexpected end of data");
+			break;
+		}
+		strm.next_in = inbuf;
+		strm.avail_in = n;
+
+		do {
+			strm.next_out = outbuf;
+			strm.avail_out = CHUNK;
+			ret = inflate(&strm, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				warn("gunzip: %s", strm.msg ? strm.msg : "corrupt data");
+				break;
+			}
+			size_t have = CHUNK - strm.avail_out;
+			if (have && xwrite(outfd, outbuf, have) < 0)
+				die("write:");
+			if (crc)
+				*crc = crc32c(*crc, outbuf, have);
+		} while (strm.avail_out == 0 && ret != Z_STREAM_END);
+	}
+
+	inflateEnd(&strm);
+	free(outbuf);
+	free(inbuf);
+
+	return ret == Z_STREAM_END ? 0 : -1;
+}
@@ -0,0 +1,6 @@
+#ifndef GZIP_H
+#define GZIP_H
+int isgzip(int fd);
+void gzipfd(int infd, int outfd, off_t *in, off_t *out);
+int gunzipfd(int infd, int outfd, uint32_t *crc);
+#endif
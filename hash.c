@@ -0,0 +1,294 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "hash.h"
+#include "util.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+/* the reflected Castagnoli polynomial */
+#define CRC32CPOLY 0x82F63B78
+#define CRCCHUNK (1 << 20)
+#define CRCWINDOW (64 << 20)
+
+
+/* function declarations */
+static uint64_t rotl(uint64_t x, int r);
+static uint64_t read64(const unsigned char *p);
+static uint32_t read32(const unsigned char *p);
+static uint64_t round64(uint64_t acc, uint64_t input);
+static uint64_t merge64(uint64_t acc, uint64_t val);
+static void crc32cinit(void);
+static uint32_t crc32csw(uint32_t crc, const unsigned char *p, size_t len);
+#if defined(__x86_64__)
+static uint32_t crc32chw(uint32_t crc, const unsigned char *p, size_t len);
+#endif
+
+
+/* global variables */
+static uint32_t crc32ctable[8][256];
+static uint32_t (*crc32cimpl)(uint32_t, const unsigned char *, size_t);
+static pthread_once_t crc32conce = PTHREAD_ONCE_INIT;
+
+
+/* function implementations */
+static uint64_t
+rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t
+read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+static uint32_t
+read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+static uint64_t
+round64(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME2;
+	acc = rotl(acc, 31);
+
+	return acc * PRIME1;
+}
+
+static uint64_t
+merge64(uint64_t acc, uint64_t val)
+{
+	acc ^= round64(0, val);
+
+	return acc * PRIME1 + PRIME4;
+}
+
+/*
+ * XXH64 of buf on a little endian machine.  The four independent lanes of
+ * the main loop keep several multipliers busy per cycle, so it runs at a
+ * good fraction of memory bandwidth.
+ */
+uint64_t
+xxh64(const void *buf, size_t len, uint64_t seed)
+{
+	const unsigned char *p = buf;
+	const unsigned char *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + PRIME1 + PRIME2;
+		uint64_t v2 = seed + PRIME2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - PRIME1;
+
+		for (; p + 32 <= end; p += 32) {
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+		}
+
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else {
+		h = seed + PRIME5;
+	}
+
+	h += len;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= round64(0, read64(p));
+		h = rotl(h, 27) * PRIME1 + PRIME4;
+	}
+	if (p + 4 <= end) {
+		h ^= read32(p) * PRIME1;
+		h = rotl(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * PRIME5;
+		h = rotl(h, 11) * PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+/* Hash the size bytes of the file open on fd, return -1 if it can't be mapped. */
+int
+hashfile(int fd, off_t size, uint64_t *hash)
+{
+	if (size == 0) {
+		*hash = xxh64(NULL, 0, 0);
+		return 0;
+	}
+
+	void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	madvise(p, size, MADV_SEQUENTIAL);
+
+	*hash = xxh64(p, size, 0);
+	munmap(p, size);
+
+	return 0;
+}
+
+/* Pick the CRC32C implementation, SSE 4.2 has an instruction for it. */
+static void
+crc32cinit(void)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32cimpl = crc32chw;
+		return;
+	}
+#endif
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32CPOLY : crc >> 1;
+		crc32ctable[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++)
+		for (int t = 1; t < 8; t++)
+			crc32ctable[t][i] = (crc32ctable[t - 1][i] >> 8) ^
+				crc32ctable[0][crc32ctable[t - 1][i] & 0xff];
+
+	crc32cimpl = crc32csw;
+}
+
+/* slicing by 8, eight table lookups per 8 bytes */
+static uint32_t
+crc32csw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	for (; len >= 8; p += 8, len -= 8) {
+		uint32_t lo, hi;
+		memcpy(&lo, p, sizeof(lo));
+		memcpy(&hi, p + 4, sizeof(hi));
+		lo ^= crc;
+		crc = crc32ctable[7][lo & 0xff] ^ crc32ctable[6][(lo >> 8) & 0xff] ^
+			crc32ctable[5][(lo >> 16) & 0xff] ^ crc32ctable[4][lo >> 24] ^
+			crc32ctable[3][hi & 0xff] ^ crc32ctable[2][(hi >> 8) & 0xff] ^
+			crc32ctable[1][(hi >> 16) & 0xff] ^ crc32ctable[0][hi >> 24];
+	}
+	for (; len > 0; p++, len--)
+		crc = (crc >> 8) ^ crc32ctable[0][(crc ^ *p) & 0xff];
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32chw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t crc64 = crc;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+	crc = crc64;
+	for (; len > 0; p++, len--)
+		crc = _mm_crc32_u8(crc, *p);
+
+	return crc;
+}
+#endif
+
+/*
+ * Continue the CRC32C crc, 0 to start, over len bytes of buf.  The
+ * SSE 4.2 instruction is used where the processor has it.
+ */
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32conce, crc32cinit);
+
+	return ~crc32cimpl(~crc, buf, len);
+}
+
+/*
+ * Compute the CRC32C of the file open on fd into *crc and its length into
+ * *len.  It's mapped a window at a time, or read a chunk at a time where
+ * it can't be mapped, so only a window of it is ever held in memory.
+ * Return -1 on a read error.
+ */
+int
+crc32cfile(int fd, uint32_t *crc, off_t *len)
+{
+	struct stat statbuf;
+
+	*crc = 0;
+	*len = 0;
+	if (fstat(fd, &statbuf) < 0)
+		return -1;
+
+	if (S_ISREG(statbuf.st_mode)) {
+		for (; *len < statbuf.st_size; *len += CRCWINDOW) {
+			size_t n = statbuf.st_size - *len < CRCWINDOW ? statbuf.st_size - *len : CRCWINDOW;
+			void *p = mmap(NULL, n, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, *len);
+			if (p == MAP_FAILED)
+				break;
+			*crc = crc32c(*crc, p, n);
+			munmap(p, n);
+		}
+		if (*len >= statbuf.st_size) {
+			*len = statbuf.st_size;
+			return 0;
+		}
+		if (lseek(fd, *len, SEEK_SET) < 0)
+			return -1;
+	}
+
+	unsigned char *buf = xmalloc(CRCCHUNK);
+	ssize_t n;
+	while ((n = read(fd, buf, CRCCHUNK)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			return -1;
+		}
+		*crc = crc32c(*crc, buf, n);
+		*len += n;
+	}
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,7 @@
+#ifndef HASH_H
+#define HASH_H
+uint64_t xxh64(const void *buf, size_t len, uint64_t seed);
+int hashfile(int fd, off_t size, uint64_t *hash);
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+int crc32cfile(int fd, uint32_t *crc, off_t *len);
+#endif
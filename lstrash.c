@@ -1,11 +1,13 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "trash.h"
 #include "util.h"
 
-char *arguments = "[-h] [TRASHDIR]";
+char *arguments = "[-hcrm] [TRASHDIR...] | -e FILE [PATTERN...]";
 
 void
 show_help(char *program_name)
@@ -13,35 +15,101 @@ show_help(char *program_name)
 	die("Usage: %s %s", program_name, arguments);
 }
 
+/* List trash, or check it if check is set, and return the exit status. */
+int
+lstrash(Trash *trash, int check, int repair)
+{
+	if (!check) {
+		trashlist(trash);
+		return EXIT_SUCCESS;
+	}
+
+	size_t nproblems = trashcheck(trash, repair);
+	if (nproblems)
+		printf("%zu problem%s found\n", nproblems, nproblems == 1 ? "" : "s");
+
+	return nproblems && !repair ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int
 main(int argc, char *argv[])
 {
+	int check = 0;
+	int repair = 0;
+	int metrics = 0;
+	char *export = NULL;
+
 	int opt;
-	while ((opt = getopt(argc, argv, "h")) != -1) {
+	while ((opt = getopt(argc, argv, "hcrme:")) != -1) {
 		switch (opt) {
 		case 'h':
 			if (argc > 2)
 				die("Unknown argument: %s", argv[2]);
 			show_help(argv[0]);
 			break;
+		case 'c':
+			check = 1;
+			break;
+		case 'r':
+			check = repair = 1;
+			break;
+		case 'm':
+			metrics = 1;
+			break;
+		case 'e':
+			export = optarg;
+			break;
 		case '?':
 			show_help(argv[0]);
 		}
 	}
 
 	Trash *trash;
+	int status = EXIT_SUCCESS;
+
+	/* with -e the arguments are the patterns of the entries to export */
+	if (export) {
+		int fd = STDOUT_FILENO;
+		if (strcmp(export, "-") != 0 &&
+				(fd = open(export, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
+			die("open: cannot open '%s':", export);
+
+		trash = opentrash(NULL);
+		trashexport(trash, fd, argv + optind, argc - optind);
+		closetrash(trash);
+
+		if (close(fd) < 0)
+			die("close:");
+		return status;
+	}
+
+	/* the metrics of every trash go in one exposition, each family once */
+	if (metrics) {
+		size_t ntrashes = optind < argc ? (size_t)(argc - optind) : 1;
+		Trash *trashes[ntrashes];
+		for (size_t i = 0; i < ntrashes; i++)
+			trashes[i] = opentrash(optind < argc ? argv[optind + i] : NULL);
+
+		trashmetrics(trashes, ntrashes);
+
+		for (size_t i = 0; i < ntrashes; i++)
+			closetrash(trashes[i]);
+		return status;
+	}
+
 	if (optind >= argc) {
 		trash = opentrash(NULL);
-		trashlist(trash);
+		status = lstrash(trash, check, repair);
+		closetrash(trash);
 	}
 
 	for (; optind < argc; optind++) {
 		printf("Trash: %s\n", argv[optind]);
 		trash = opentrash(argv[optind]);
-		trashlist(trash);
+		if (lstrash(trash, check, repair) != EXIT_SUCCESS)
+			status = EXIT_FAILURE;
+		closetrash(trash);
 	}
 
-	closetrash(trash);
-
-	return EXIT_SUCCESS;
+	return status;
 }
@@ -5,7 +5,7 @@
 #include "trash.h"
 #include "util.h"
 
-char *arguments = "[-h] [file...]";
+char *arguments = "[-hdk] [file...]";
 
 void
 show_help(char *program_name)
@@ -19,18 +19,29 @@ main(int argc, char *argv[])
 	if (argc < 2)
 		show_help(argv[0]);
 
+	int dedup = 0;
+	int checksum = 0;
+
 	int opt;
-	while ((opt = getopt(argc, argv, "h")) != -1) {
+	while ((opt = getopt(argc, argv, "hdk")) != -1) {
 		switch (opt) {
 		case 'h':
 			show_help(argv[0]);
 			break;
+		case 'd':
+			dedup = 1;
+			break;
+		case 'k':
+			checksum = 1;
+			break;
 		case '?':
 			show_help(argv[0]);
 		}
 	}
 
 	Trash *trash = opentrash(NULL);
+	trashsetdedup(trash, dedup);
+	trashsetchecksum(trash, checksum);
 	for (; optind < argc; optind++)
 		trashput(trash, argv[optind]);
 	closetrash(trash);
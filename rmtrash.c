@@ -5,7 +5,7 @@
 #include "trash.h"
 #include "util.h"
 
-char *arguments = "[-ha] [PATTERN]";
+char *arguments = "[-hanD] [-r RATE] [-i IOPS] [-z AGE] [PATTERN]";
 
 void
 show_help(char *program_name)
@@ -21,9 +21,15 @@ main(int argc, char *argv[])
 		show_help(argv[0]);
 
 	int remove_all = 0;
+	int dedup = 0;
+	int compress = 0;
+	time_t age = 0;
+	int idle = 0;
+	unsigned long long rate = 0;
+	unsigned long long iops = 0;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "ah")) != -1) {
+	while ((opt = getopt(argc, argv, "ahnDr:i:z:")) != -1) {
 		switch (opt) {
 		case 'h':
 			show_help(argv[0]);
@@ -31,22 +37,55 @@ main(int argc, char *argv[])
 		case 'a':
 				remove_all = 1;
 			break;
+		case 'n':
+			idle = 1;
+			break;
+		case 'D':
+			dedup = 1;
+			break;
+		case 'r':
+			if (parsesize(optarg, &rate) < 0)
+				die("Invalid rate: %s", optarg);
+			break;
+		case 'i':
+			if (parsesize(optarg, &iops) < 0)
+				die("Invalid IOPS: %s", optarg);
+			break;
+		case 'z':
+			if (parseduration(optarg, &age) < 0)
+				die("Invalid age: %s", optarg);
+			compress = 1;
+			break;
 		case '?':
 			show_help(argv[0]);
 		}
 	}
 
-	if (remove_all && optind < argc) {
+	if ((remove_all || dedup || compress) && optind < argc) {
 		printf("Unknown arguments '%s'\n", argv[optind]);
 		show_help(argv[0]);
 	}
 
+	if (remove_all + dedup + compress > 1)
+		show_help(argv[0]);
+
+	if (!remove_all && !dedup && !compress && optind >= argc)
+		show_help(argv[0]);
+
+	if (idle)
+		idleioprio();
+
 	Trash *trash = opentrash(NULL);
+	trashthrottle(trash, rate, iops);
 
 	if (remove_all)
 		trashclean(trash);
+	else if (dedup)
+		trashdedup(trash);
+	else if (compress)
+		trashcompress(trash, age);
 	else
-		trashremove(trash, argv[1]);
+		trashremove(trash, argv[optind]);
 
 	closetrash(trash);
 
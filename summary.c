@@ -0,0 +1,350 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "summary.h"
+#include "util.h"
+
+#define DAY 86400
+
+/*
+ * The summary of a trash is kept in $Trash/summary and updated on every
+ * put, remove and restore, so reporting on a trash never has to read it.
+ *
+ * The oldest and newest deletion times are tracked per day along with
+ * how many entries have them.  When the last of those goes away, the bound
+ * widens to the start or end of that day, so they are exact until then and
+ * never off by more than a day.
+ */
+struct day {
+	long day;
+	long long count;
+	time_t min;
+	long long nmin;
+	time_t max;
+	long long nmax;
+};
+
+/* entries under a top level directory such as /home */
+struct dir {
+	char *name;
+	long long count;
+	long long bytes;
+};
+
+struct summary {
+	long long entries;
+	long long bytes;
+	struct day *days;
+	size_t ndays;
+	struct dir *dirs;
+	size_t ndirs;
+};
+
+
+/* function declarations */
+static struct day *getday(struct summary *summary, long day);
+static struct dir *getdir(struct summary *summary, const char *name);
+static void printlabel(const char *value);
+
+
+/* function implementations */
+struct summary *
+createsummary(void)
+{
+	struct summary *summary = xmalloc(sizeof(*summary));
+
+	summary->entries = 0;
+	summary->bytes = 0;
+	summary->days = NULL;
+	summary->ndays = 0;
+	summary->dirs = NULL;
+	summary->ndirs = 0;
+
+	return summary;
+}
+
+/* Return the summary kept in dirfd, or NULL if there is none. */
+struct summary *
+readsummary(int dirfd)
+{
+	int fd = openat(dirfd, "summary", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return NULL;
+		die("open: cannot open summary:");
+	}
+
+	FILE *file = fdopen(fd, "r");
+	if (!file)
+		die("fdopen:");
+
+	struct summary *summary = createsummary();
+
+	char *line = NULL;
+	size_t len = 0;
+	while (getline(&line, &len, file) != -1) {
+		long day;
+		long long count, bytes, min, nmin, max, nmax;
+		char name[strlen(line) + 1];
+
+		if (sscanf(line, "entries %lld", &count) == 1) {
+			summary->entries = count;
+		} else if (sscanf(line, "bytes %lld", &bytes) == 1) {
+			summary->bytes = bytes;
+		} else if (sscanf(line, "day %ld %lld %lld %lld %lld %lld", &day, &count,
+					&min, &nmin, &max, &nmax) == 6) {
+			struct day *d = getday(summary, day);
+			d->count = count;
+			d->min = min;
+			d->nmin = nmin;
+			d->max = max;
+			d->nmax = nmax;
+		} else if (sscanf(line, "dir %s %lld %lld", name, &count, &bytes) == 3) {
+			char *decoded = uri_decode(name);
+			struct dir *d = getdir(summary, decoded);
+			d->count = count;
+			d->bytes = bytes;
+			free(decoded);
+		}
+	}
+	free(line);
+	if (fclose(file) == EOF)
+		die("fclose:");
+
+	return summary;
+}
+
+/* Replace the summary kept in dirfd, the caller holds the trash lock. */
+void
+writesummary(struct summary *summary, int dirfd)
+{
+	int fd = openat(dirfd, "summary.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		die("open: cannot write summary:");
+
+	FILE *file = fdopen(fd, "w");
+	if (!file)
+		die("fdopen:");
+
+	fprintf(file, "entries %lld\n", summary->entries);
+	fprintf(file, "bytes %lld\n", summary->bytes);
+	for (size_t i = 0; i < summary->ndays; i++) {
+		struct day *d = &summary->days[i];
+		fprintf(file, "day %ld %lld %lld %lld %lld %lld\n", d->day, d->count,
+				(long long)d->min, d->nmin, (long long)d->max, d->nmax);
+	}
+	for (size_t i = 0; i < summary->ndirs; i++) {
+		struct dir *d = &summary->dirs[i];
+		char *encoded = uri_encode(d->name);
+		fprintf(file, "dir %s %lld %lld\n", encoded, d->count, d->bytes);
+		free(encoded);
+	}
+
+	if (fclose(file) == EOF)
+		die("fclose: cannot write summary:");
+
+	if (renameat(dirfd, "summary.tmp", dirfd, "summary") < 0)
+		die("rename: cannot write summary:");
+}
+
+void
+freesummary(struct summary *summary)
+{
+	for (size_t i = 0; i < summary->ndirs; i++)
+		free(summary->dirs[i].name);
+	free(summary->dirs);
+	free(summary->days);
+	free(summary);
+}
+
+/* Return the bucket of day, inserting an empty one in order if needed. */
+static struct day *
+getday(struct summary *summary, long day)
+{
+	size_t i = 0;
+	while (i < summary->ndays && summary->days[i].day < day)
+		i++;
+	if (i < summary->ndays && summary->days[i].day == day)
+		return &summary->days[i];
+
+	summary->days = realloc(summary->days, (summary->ndays + 1) * sizeof(*summary->days));
+	if (!summary->days)
+		die("realloc:");
+	memmove(&summary->days[i + 1], &summary->days[i],
+			(summary->ndays - i) * sizeof(*summary->days));
+	summary->ndays++;
+	summary->days[i] = (struct day){ day, 0, (time_t)day * DAY + DAY - 1, 0, (time_t)day * DAY, 0 };
+
+	return &summary->days[i];
+}
+
+static struct dir *
+getdir(struct summary *summary, const char *name)
+{
+	for (size_t i = 0; i < summary->ndirs; i++)
+		if (strcmp(summary->dirs[i].name, name) == 0)
+			return &summary->dirs[i];
+
+	summary->dirs = realloc(summary->dirs, (summary->ndirs + 1) * sizeof(*summary->dirs));
+	if (!summary->dirs)
+		die("realloc:");
+
+	struct dir *d = &summary->dirs[summary->ndirs++];
+	d->name = xmalloc(strlen(name) + 1);
+	strcpy(d->name, name);
+	d->count = 0;
+	d->bytes = 0;
+
+	return d;
+}
+
+/*
+ * Account for an entry of size bytes deleted from deletedfilepath at
+ * deletiontime being added to the trash (sign 1) or leaving it (sign -1).
+ */
+void
+summaryadd(struct summary *summary, time_t deletiontime, long long size,
+		const char *deletedfilepath, int sign)
+{
+	summary->entries += sign;
+	summary->bytes += sign * size;
+
+	long day = deletiontime >= 0 ? deletiontime / DAY : (deletiontime + 1) / DAY - 1;
+	struct day *d = getday(summary, day);
+	d->count += sign;
+	if (sign > 0) {
+		if (deletiontime < d->min || d->count == 1) {
+			d->min = deletiontime;
+			d->nmin = 0;
+		}
+		if (deletiontime == d->min)
+			d->nmin++;
+		if (deletiontime > d->max || d->count == 1) {
+			d->max = deletiontime;
+			d->nmax = 0;
+		}
+		if (deletiontime == d->max)
+			d->nmax++;
+	} else {
+		if (deletiontime == d->min && d->nmin > 0 && --d->nmin == 0)
+			d->min = (time_t)day * DAY;
+		if (deletiontime == d->max && d->nmax > 0 && --d->nmax == 0)
+			d->max = (time_t)day * DAY + DAY - 1;
+	}
+	if (d->count <= 0) {
+		size_t i = d - summary->days;
+		memmove(d, d + 1, (summary->ndays - i - 1) * sizeof(*d));
+		summary->ndays--;
+	}
+
+	/* the top level directory, "/" for files directly in it */
+	const char *sep = strchr(deletedfilepath + 1, '/');
+	size_t namelen = sep ? (size_t)(sep - deletedfilepath) : 1;
+	char name[namelen + 1];
+	memcpy(name, deletedfilepath, namelen);
+	name[namelen] = '\0';
+
+	struct dir *dir = getdir(summary, name);
+	dir->count += sign;
+	dir->bytes += sign * size;
+	if (dir->count <= 0) {
+		free(dir->name);
+		*dir = summary->dirs[--summary->ndirs];
+	}
+}
+
+static void
+printlabel(const char *value)
+{
+	for (; *value; value++) {
+		if (*value == '\\' || *value == '"')
+			printf("\\%c", *value);
+		else if (*value == '\n')
+			printf("\\n");
+		else
+			putchar(*value);
+	}
+}
+
+/* Print the start of a sample of the metric name for the trash trashdirpath. */
+static void
+printsample(const char *name, const char *trashdirpath)
+{
+	printf("%s{trash=\"", name);
+	printlabel(trashdirpath);
+}
+
+/*
+ * Print the n summaries in the Prometheus text format, those of
+ * summaries[i] labelled with trashdirpaths[i].  Each metric family is
+ * printed once, with the samples of every trash.
+ */
+void
+printsummaries(struct summary **summaries, const char **trashdirpaths, size_t n)
+{
+	printf("# HELP trash_entries Number of entries in the trash.\n"
+			"# TYPE trash_entries gauge\n");
+	for (size_t i = 0; i < n; i++) {
+		printsample("trash_entries", trashdirpaths[i]);
+		printf("\"} %lld\n", summaries[i]->entries);
+	}
+
+	printf("# HELP trash_bytes Disk space used by the entries in the trash.\n"
+			"# TYPE trash_bytes gauge\n");
+	for (size_t i = 0; i < n; i++) {
+		printsample("trash_bytes", trashdirpaths[i]);
+		printf("\"} %lld\n", summaries[i]->bytes);
+	}
+
+	int hasdays = 0;
+	for (size_t i = 0; i < n; i++)
+		hasdays |= summaries[i]->ndays > 0;
+
+	if (hasdays) {
+		printf("# HELP trash_oldest_deletion_timestamp_seconds Deletion time of the oldest entry.\n"
+				"# TYPE trash_oldest_deletion_timestamp_seconds gauge\n");
+		for (size_t i = 0; i < n; i++) {
+			if (summaries[i]->ndays == 0)
+				continue;
+			printsample("trash_oldest_deletion_timestamp_seconds", trashdirpaths[i]);
+			printf("\"} %lld\n", (long long)summaries[i]->days[0].min);
+		}
+
+		printf("# HELP trash_newest_deletion_timestamp_seconds Deletion time of the newest entry.\n"
+				"# TYPE trash_newest_deletion_timestamp_seconds gauge\n");
+		for (size_t i = 0; i < n; i++) {
+			if (summaries[i]->ndays == 0)
+				continue;
+			printsample("trash_newest_deletion_timestamp_seconds", trashdirpaths[i]);
+			printf("\"} %lld\n", (long long)summaries[i]->days[summaries[i]->ndays - 1].max);
+		}
+	}
+
+	printf("# HELP trash_dir_entries Number of entries by top level directory they were deleted from.\n"
+			"# TYPE trash_dir_entries gauge\n");
+	for (size_t i = 0; i < n; i++) {
+		for (size_t j = 0; j < summaries[i]->ndirs; j++) {
+			printsample("trash_dir_entries", trashdirpaths[i]);
+			printf("\",dir=\"");
+			printlabel(summaries[i]->dirs[j].name);
+			printf("\"} %lld\n", summaries[i]->dirs[j].count);
+		}
+	}
+
+	printf("# HELP trash_dir_bytes Disk space used by entries by top level directory they were deleted from.\n"
+			"# TYPE trash_dir_bytes gauge\n");
+	for (size_t i = 0; i < n; i++) {
+		for (size_t j = 0; j < summaries[i]->ndirs; j++) {
+			printsample("trash_dir_bytes", trashdirpaths[i]);
+			printf("\",dir=\"");
+			printlabel(summaries[i]->dirs[j].name);
+			printf("\"} %lld\n", summaries[i]->dirs[j].bytes);
+		}
+	}
+}
@@ -0,0 +1,13 @@
+#ifndef SUMMARY_H
+#define SUMMARY_H
+struct summary;
+
+struct summary *createsummary(void);
+struct summary *readsummary(int dirfd);
+void writesummary(struct summary *summary, int dirfd);
+void freesummary(struct summary *summary);
+
+void summaryadd(struct summary *summary, time_t deletiontime, long long size,
+		const char *deletedfilepath, int sign);
+void printsummaries(struct summary **summaries, const char **trashdirpaths, size_t n);
+#endif
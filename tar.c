@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tar.h"
+#include "util.h"
+
+#define BLOCKSIZE 512
+/* how many files of a directory are read ahead of the one being archived */
+#define PREFETCH 16
+
+/* a POSIX ustar header */
+struct ustar {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+
+/* function declarations */
+static void putpad(int fd, off_t size);
+static void putpaxrecord(char **buf, size_t *len, const char *key, const char *value);
+static void putheader(int fd, const char *name, const char *linkname, char type,
+		const struct stat *statbuf);
+static void putdata(int fd, int infd, off_t size);
+static int prefetch(int dirfd, const char *path);
+static size_t putentry(int fd, const char *name, int dirfd, const char *path, int infd, int intree);
+static size_t putdir(int fd, const char *name, int dirfd);
+static int readblock(int fd, char *block);
+static unsigned long checksum(const char *block);
+static long long getoctal(const char *field, size_t len);
+static struct timespec parsepaxtime(const char *value);
+static void skippad(int fd, off_t size);
+
+
+/* function implementations */
+static void
+putpad(int fd, off_t size)
+{
+	static const char zeros[BLOCKSIZE];
+	size_t pad = (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE;
+
+	if (pad && xwrite(fd, zeros, pad) < 0)
+		die("write:");
+}
+
+/* append a "len key=value\n" record, len counts the whole record */
+static void
+putpaxrecord(char **buf, size_t *len, const char *key, const char *value)
+{
+	size_t base = strlen(key) + strlen(value) + strlen(" =\n");
+	size_t reclen = base;
+	while (reclen != base + snprintf(NULL, 0, "%zu", reclen))
+		reclen = base + snprintf(NULL, 0, "%zu", reclen);
+
+	*buf = realloc(*buf, *len + reclen + 1);
+	if (!*buf)
+		die("realloc:");
+	*len += sprintf(*buf + *len, "%zu %s=%s\n", reclen, key, value);
+}
+
+/*
+ * Write the header of a member, preceded by a pax extended header when
+ * the names or the size don't fit in the ustar fields or the modification
+ * time has a fraction of a second.
+ */
+static void
+putheader(int fd, const char *name, const char *linkname, char type,
+		const struct stat *statbuf)
+{
+	off_t size = type == '0' ? statbuf->st_size : 0;
+	char *pax = NULL;
+	size_t paxlen = 0;
+
+	if (strlen(name) >= sizeof(((struct ustar *)0)->name))
+		putpaxrecord(&pax, &paxlen, "path", name);
+	if (linkname && strlen(linkname) >= sizeof(((struct ustar *)0)->linkname))
+		putpaxrecord(&pax, &paxlen, "linkpath", linkname);
+	if (size > 077777777777LL) {
+		char sizestr[3 * sizeof(size) + 1];
+		sprintf(sizestr, "%lld", (long long)size);
+		putpaxrecord(&pax, &paxlen, "size", sizestr);
+	}
+	if (type != 'x' && statbuf->st_mtim.tv_nsec != 0) {
+		char mtimestr[3 * sizeof(long long) + 1 + 9 + 1];
+		sprintf(mtimestr, "%lld.%09ld",
+				(long long)statbuf->st_mtim.tv_sec, statbuf->st_mtim.tv_nsec);
+		putpaxrecord(&pax, &paxlen, "mtime", mtimestr);
+	}
+
+	if (pax) {
+		struct stat paxstat = *statbuf;
+		paxstat.st_size = paxlen;
+		paxstat.st_mtim.tv_nsec = 0;
+		putheader(fd, "PaxHeader", NULL, 'x', &paxstat);
+		if (xwrite(fd, pax, paxlen) < 0)
+			die("write:");
+		putpad(fd, paxlen);
+		free(pax);
+	}
+
+	union {
+		struct ustar h;
+		char block[BLOCKSIZE];
+	} u;
+	memset(&u, 0, sizeof(u));
+
+	if (type == 'x')
+		size = statbuf->st_size;
+
+	strncpy(u.h.name, name, sizeof(u.h.name));
+	snprintf(u.h.mode, sizeof(u.h.mode), "%07o", (unsigned)(statbuf->st_mode & 07777));
+	snprintf(u.h.uid, sizeof(u.h.uid), "%07o", (unsigned)(statbuf->st_uid & 07777777));
+	snprintf(u.h.gid, sizeof(u.h.gid), "%07o", (unsigned)(statbuf->st_gid & 07777777));
+	snprintf(u.h.size, sizeof(u.h.size), "%011llo",
+			(unsigned long long)(size > 077777777777LL ? 0 : size));
+	snprintf(u.h.mtime, sizeof(u.h.mtime), "%011llo",
+			(unsigned long long)(statbuf->st_mtime & 077777777777LL));
+	u.h.typeflag = type;
+	if (linkname)
+		strncpy(u.h.linkname, linkname, sizeof(u.h.linkname));
+	memcpy(u.h.magic, "ustar", sizeof(u.h.magic));
+	memcpy(u.h.version, "00", sizeof(u.h.version));
+
+	memset(u.h.chksum, ' ', sizeof(u.h.chksum));
+	snprintf(u.h.chksum, sizeof(u.h.chksum), "%06lo", checksum(u.block));
+
+	if (xwrite(fd, u.block, BLOCKSIZE) < 0)
+		die("write:");
+}
+
+/*
+ * Write size bytes of infd and the padding after them.  The data goes
+ * from the page cache to fd in the kernel, user space copies are only
+ * used where sendfile isn't supported.  A file that shrank while being
+ * written is padded with zeros.
+ */
+static void
+putdata(int fd, int infd, off_t size)
+{
+	off_t left = size;
+	int usesendfile = 1;
+	char buf[1 << 16];
+
+	while (left > 0) {
+		ssize_t n;
+		size_t count = left > 1 << 30 ? 1 << 30 : left;
+
+		if (usesendfile) {
+			n = sendfile(fd, infd, NULL, count);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				usesendfile = 0;
+				continue;
+			}
+		} else {
+			n = read(infd, buf, count > sizeof(buf) ? sizeof(buf) : count);
+			if (n > 0 && xwrite(fd, buf, n) < 0)
+				die("write:");
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			die("sendfile:");
+		}
+		if (n == 0)
+			break;
+		left -= n;
+	}
+
+	static const char zeros[BLOCKSIZE];
+	for (; left > 0; left -= left > BLOCKSIZE ? BLOCKSIZE : left)
+		if (xwrite(fd, zeros, left > BLOCKSIZE ? BLOCKSIZE : left) < 0)
+			die("write:");
+
+	putpad(fd, size);
+}
+
+/* Open path and start reading it in the background, return -1 if it can't be opened. */
+static int
+prefetch(int dirfd, const char *path)
+{
+	int fd = openat(dirfd, path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+
+	if (fd >= 0)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+	return fd;
+}
+
+/*
+ * Archive path in dirfd as name.  infd is path opened by prefetch(), or -1.
+ * It's closed.  Return the number of files that couldn't be archived as
+ * they are: special files are skipped and a file in a tree (intree) with
+ * other hardlinks is archived as a copy of its own.
+ */
+static size_t
+putentry(int fd, const char *name, int dirfd, const char *path, int infd, int intree)
+{
+	struct stat statbuf;
+	size_t nlost = 0;
+
+	if (infd >= 0) {
+		if (fstat(infd, &statbuf) < 0)
+			die("stat:");
+	} else if (fstatat(dirfd, path, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+		die("stat: cannot stat '%s':", name);
+	}
+
+	if (infd < 0 && (S_ISREG(statbuf.st_mode) || S_ISDIR(statbuf.st_mode))) {
+		infd = openat(dirfd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (infd < 0)
+			die("open: cannot open '%s':", name);
+	}
+
+	if (S_ISREG(statbuf.st_mode)) {
+		putheader(fd, name, NULL, '0', &statbuf);
+		putdata(fd, infd, statbuf.st_size);
+		nlost += intree && statbuf.st_nlink > 1;
+	} else if (S_ISDIR(statbuf.st_mode)) {
+		char dirname[strlen(name) + 2];
+		sprintf(dirname, "%s/", name);
+		putheader(fd, dirname, NULL, '5', &statbuf);
+		nlost += putdir(fd, name, infd);
+	} else if (S_ISLNK(statbuf.st_mode)) {
+		char linkname[PATH_MAX];
+		ssize_t len = readlinkat(dirfd, path, linkname, sizeof(linkname) - 1);
+		if (len < 0)
+			die("readlink: cannot read '%s':", name);
+		linkname[len] = '\0';
+		putheader(fd, name, linkname, '2', &statbuf);
+	} else {
+		nlost++;
+	}
+
+	if (infd >= 0)
+		close(infd);
+
+	return nlost;
+}
+
+/*
+ * Archive the contents of the directory open on dirfd.  The files
+ * PREFETCH entries ahead are already open and being read into the page
+ * cache, so the disk works on many small files at once.
+ */
+static size_t
+putdir(int fd, const char *name, int dirfd)
+{
+	struct dirlist list;
+	size_t nlost = 0;
+	listdir(dirfd, &list);
+
+	int fds[PREFETCH];
+	for (size_t i = 0; i < PREFETCH && i < list.len; i++)
+		fds[i] = prefetch(dirfd, list.names[i]);
+
+	for (size_t i = 0; i < list.len; i++) {
+		int infd = fds[i % PREFETCH];
+		if (i + PREFETCH < list.len)
+			fds[i % PREFETCH] = prefetch(dirfd, list.names[i + PREFETCH]);
+
+		char childname[strlen(name) + 1 + strlen(list.names[i]) + 1];
+		sprintf(childname, "%s/%s", name, list.names[i]);
+		nlost += putentry(fd, childname, dirfd, list.names[i], infd, 1);
+	}
+
+	freedirlist(&list);
+
+	return nlost;
+}
+
+/*
+ * Write path in dirfd and everything below it to the archive fd as name.
+ * Return the number of files that couldn't be archived as they are, FIFOs,
+ * sockets and devices are left out and hardlinks within a tree are split.
+ */
+size_t
+tarputfile(int fd, const char *name, int dirfd, const char *path)
+{
+	return putentry(fd, name, dirfd, path, -1, 0);
+}
+
+/* Write the end of archive marker. */
+void
+tarputend(int fd)
+{
+	static const char zeros[2 * BLOCKSIZE];
+
+	if (xwrite(fd, zeros, sizeof(zeros)) < 0)
+		die("write:");
+}
+
+/* Read a block, return 0 at the end of the input. */
+static int
+readblock(int fd, char *block)
+{
+	size_t len = 0;
+
+	while (len < BLOCKSIZE) {
+		ssize_t n = read(fd, block + len, BLOCKSIZE - len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			die("read:");
+		}
+		if (n == 0) {
+			if (len)
+				die("tar: unexpected end of archive");
+			return 0;
+		}
+		len += n;
+	}
+
+	return 1;
+}
+
+static unsigned long
+checksum(const char *block)
+{
+	unsigned long sum = 0;
+
+	for (size_t i = 0; i < BLOCKSIZE; i++)
+		sum += (unsigned char)block[i];
+
+	return sum;
+}
+
+static long long
+getoctal(const char *field, size_t len)
+{
+	long long n = 0;
+
+	for (size_t i = 0; i < len && field[i]; i++) {
+		if (field[i] == ' ')
+			continue;
+		if (field[i] < '0' || field[i] > '7')
+			die("tar: invalid number in header");
+		n = n * 8 + (field[i] - '0');
+	}
+
+	return n;
+}
+
+/* Parse a pax time, seconds with an optional fraction. */
+static struct timespec
+parsepaxtime(const char *value)
+{
+	char *frac;
+	struct timespec ts = { strtoll(value, &frac, 10), 0 };
+
+	if (*frac == '.') {
+		long scale = 100000000;
+		for (frac++; *frac >= '0' && *frac <= '9' && scale > 0; frac++, scale /= 10)
+			ts.tv_nsec += (*frac - '0') * scale;
+	}
+
+	return ts;
+}
+
+/*
+ * Read the header of the next member into hdr, applying pax extended
+ * headers and GNU long names.  Return 0 at the end of the archive.
+ */
+int
+targetheader(int fd, struct tarhdr *hdr)
+{
+	union {
+		struct ustar h;
+		char block[BLOCKSIZE];
+	} u;
+	char *name = NULL;
+	char *linkname = NULL;
+	off_t size = -1;
+	struct timespec mtime;
+	int haspaxmtime = 0;
+
+	for (;;) {
+		if (!readblock(fd, u.block))
+			break;
+
+		static const char zeros[BLOCKSIZE];
+		if (memcmp(u.block, zeros, BLOCKSIZE) == 0)
+			break;
+
+		unsigned long sum = getoctal(u.h.chksum, sizeof(u.h.chksum));
+		memset(u.h.chksum, ' ', sizeof(u.h.chksum));
+		if (sum != checksum(u.block))
+			die("tar: invalid header checksum");
+
+		off_t datasize = getoctal(u.h.size, sizeof(u.h.size));
+
+		if (u.h.typeflag == 'x' || u.h.typeflag == 'L' || u.h.typeflag == 'K') {
+			char *data = xmalloc(datasize + 1);
+			tarreaddata(fd, data, datasize);
+			data[datasize] = '\0';
+
+			if (u.h.typeflag == 'L') {
+				free(name);
+				name = data;
+				continue;
+			}
+			if (u.h.typeflag == 'K') {
+				free(linkname);
+				linkname = data;
+				continue;
+			}
+
+			for (char *rec = data; rec < data + datasize; ) {
+				char *key;
+				long reclen = strtol(rec, &key, 10);
+				if (reclen <= 0 || *key != ' ' || rec + reclen > data + datasize)
+					die("tar: invalid pax header");
+				key++;
+				rec[reclen - 1] = '\0';
+				char *value = strchr(key, '=');
+				if (value) {
+					*value++ = '\0';
+					if (strcmp(key, "path") == 0) {
+						free(name);
+						name = xmalloc(strlen(value) + 1);
+						strcpy(name, value);
+					} else if (strcmp(key, "linkpath") == 0) {
+						free(linkname);
+						linkname = xmalloc(strlen(value) + 1);
+						strcpy(linkname, value);
+					} else if (strcmp(key, "size") == 0) {
+						size = strtoll(value, NULL, 10);
+					} else if (strcmp(key, "mtime") == 0) {
+						mtime = parsepaxtime(value);
+						haspaxmtime = 1;
+					}
+				}
+				rec += reclen;
+			}
+			free(data);
+			continue;
+		}
+
+		if (u.h.typeflag == 'g') {
+			tarskipdata(fd, datasize);
+			continue;
+		}
+
+		if (!name) {
+			size_t prefixlen = strnlen(u.h.prefix, sizeof(u.h.prefix));
+			size_t namelen = strnlen(u.h.name, sizeof(u.h.name));
+			name = xmalloc(prefixlen + 1 + namelen + 1);
+			if (prefixlen)
+				sprintf(name, "%.*s/%.*s", (int)prefixlen, u.h.prefix,
+						(int)namelen, u.h.name);
+			else
+				sprintf(name, "%.*s", (int)namelen, u.h.name);
+		}
+		if (!linkname) {
+			size_t linknamelen = strnlen(u.h.linkname, sizeof(u.h.linkname));
+			linkname = xmalloc(linknamelen + 1);
+			sprintf(linkname, "%.*s", (int)linknamelen, u.h.linkname);
+		}
+
+		hdr->name = name;
+		hdr->linkname = linkname;
+		hdr->type = u.h.typeflag ? u.h.typeflag : '0';
+		hdr->mode = getoctal(u.h.mode, sizeof(u.h.mode));
+		hdr->size = size >= 0 ? size : datasize;
+		if (haspaxmtime) {
+			hdr->mtime = mtime;
+		} else {
+			hdr->mtime.tv_sec = getoctal(u.h.mtime, sizeof(u.h.mtime));
+			hdr->mtime.tv_nsec = 0;
+		}
+
+		return 1;
+	}
+
+	free(name);
+	free(linkname);
+
+	return 0;
+}
+
+/* Skip the padding after size bytes of member data. */
+static void
+skippad(int fd, off_t size)
+{
+	off_t pad = (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE;
+	char block[BLOCKSIZE];
+
+	while (pad > 0) {
+		ssize_t n = read(fd, block, pad);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			die("read:");
+		}
+		if (n == 0)
+			die("tar: unexpected end of archive");
+		pad -= n;
+	}
+}
+
+/*
+ * Copy the size bytes of member data at fd to outfd and skip the padding.
+ * The data is moved in the kernel with splice when fd is a pipe and with
+ * copy_file_range when it's a file.
+ */
+void
+tarcopydata(int fd, int outfd, off_t size)
+{
+	off_t left = size;
+	int method = 0;
+	char buf[1 << 16];
+
+	while (left > 0) {
+		ssize_t n;
+		size_t count = left > 1 << 30 ? 1 << 30 : left;
+
+		if (method == 0)
+			n = splice(fd, NULL, outfd, NULL, count, SPLICE_F_MOVE);
+		else if (method == 1)
+			n = copy_file_range(fd, NULL, outfd, NULL, count, 0);
+		else if ((n = read(fd, buf, count > sizeof(buf) ? sizeof(buf) : count)) > 0 &&
+				xwrite(outfd, buf, n) < 0)
+			die("write:");
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (method < 2 && (errno == EINVAL || errno == EXDEV ||
+						errno == ENOSYS || errno == EBADF || errno == EOPNOTSUPP)) {
+				method++;
+				continue;
+			}
+			die("tar: cannot extract data:");
+		}
+		if (n == 0)
+			die("tar: unexpected end of archive");
+		left -= n;
+	}
+
+	skippad(fd, size);
+}
+
+/* Skip size bytes of member data and the padding after them. */
+void
+tarskipdata(int fd, off_t size)
+{
+	if (size <= 0)
+		return;
+
+	off_t skip = size + (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE;
+	if (lseek(fd, skip, SEEK_CUR) >= 0)
+		return;
+
+	char block[BLOCKSIZE];
+	for (; skip > 0; skip -= BLOCKSIZE)
+		if (!readblock(fd, block))
+			die("tar: unexpected end of archive");
+}
+
+/* Read size bytes of member data into buf and skip the padding. */
+void
+tarreaddata(int fd, char *buf, off_t size)
+{
+	off_t len = 0;
+
+	while (len < size) {
+		ssize_t n = read(fd, buf + len, size - len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			die("read:");
+		}
+		if (n == 0)
+			die("tar: unexpected end of archive");
+		len += n;
+	}
+
+	skippad(fd, size);
+}
+
+void
+freetarhdr(struct tarhdr *hdr)
+{
+	free(hdr->name);
+	free(hdr->linkname);
+}
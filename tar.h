@@ -0,0 +1,21 @@
+#ifndef TAR_H
+#define TAR_H
+/* a member header read from an archive */
+struct tarhdr {
+	char *name;
+	char *linkname;
+	char type;
+	mode_t mode;
+	off_t size;
+	struct timespec mtime;
+};
+
+size_t tarputfile(int fd, const char *name, int dirfd, const char *path);
+void tarputend(int fd);
+
+int targetheader(int fd, struct tarhdr *hdr);
+void tarcopydata(int fd, int outfd, off_t size);
+void tarskipdata(int fd, off_t size);
+void tarreaddata(int fd, char *buf, off_t size);
+void freetarhdr(struct tarhdr *hdr);
+#endif
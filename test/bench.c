@@ -0,0 +1,146 @@
+/*
+ * Run PROGRAM once per FILE, as tools trashing a file at a time do, and
+ * report the syscalls and time each run takes.  Syscalls are counted with
+ * ptrace on the first -t runs, the time is taken over the others so the
+ * tracing doesn't slow it down.  -v prints the syscall numbers of the
+ * first run, one per line.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static void
+die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+/* Run program with arg and return the number of syscalls it made. */
+static long
+traced(const char *program, const char *arg, int verbose)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0) {
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+			die("ptrace");
+		raise(SIGSTOP);
+		execl(program, program, arg, (char *)NULL);
+		die(program);
+	}
+
+	int status;
+	if (waitpid(pid, &status, 0) < 0)
+		die("waitpid");
+	if (ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL) < 0)
+		die("ptrace");
+
+	long nsyscalls = 0;
+	int sig = 0;
+	for (;;) {
+		if (ptrace(PTRACE_SYSCALL, pid, NULL, sig) < 0)
+			die("ptrace");
+		if (waitpid(pid, &status, 0) < 0)
+			die("waitpid");
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+			break;
+
+		sig = 0;
+		if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+			if (WSTOPSIG(status) != SIGTRAP)
+				sig = WSTOPSIG(status);
+			continue;
+		}
+
+		struct __ptrace_syscall_info info;
+		if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) < 0)
+			die("ptrace");
+		if (info.op != PTRACE_SYSCALL_INFO_ENTRY)
+			continue;
+		nsyscalls++;
+		if (verbose)
+			printf("%llu\n", (unsigned long long)info.entry.nr);
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		fprintf(stderr, "%s %s failed\n", program, arg);
+
+	return nsyscalls;
+}
+
+/* Run program with arg and return the microseconds it took. */
+static double
+timed(const char *program, const char *arg)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid_t pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0) {
+		execl(program, program, arg, (char *)NULL);
+		die(program);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) < 0)
+		die("waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		fprintf(stderr, "%s %s failed\n", program, arg);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ntraced = 100;
+	int verbose = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:v")) != -1) {
+		switch (c) {
+		case 't':
+			ntraced = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-v] [-t RUNS] PROGRAM FILE...\n", argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind < 2) {
+		fprintf(stderr, "Usage: %s [-v] [-t RUNS] PROGRAM FILE...\n", argv[0]);
+		return 1;
+	}
+
+	const char *program = argv[optind++];
+	int nfiles = argc - optind;
+	if (ntraced < 1 || ntraced >= nfiles)
+		ntraced = nfiles > 1 ? nfiles / 2 : 1;
+
+	long nsyscalls = 0;
+	for (int i = 0; i < ntraced; i++)
+		nsyscalls += traced(program, argv[optind + i], verbose && i == 0);
+
+	double us = 0;
+	for (int i = ntraced; i < nfiles; i++)
+		us += timed(program, argv[optind + i]);
+
+	printf("%s: %.1f syscalls per run over %d runs, %.0f us per run over %d runs\n",
+			program, (double)nsyscalls / ntraced, ntraced,
+			nfiles > ntraced ? us / (nfiles - ntraced) : 0.0, nfiles - ntraced);
+
+	return 0;
+}
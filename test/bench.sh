@@ -0,0 +1,28 @@
+#!/bin/sh
+# Trash N files (1000 by default) with one mvtrash each, first into a trash
+# without a summary and then into one with, and report the syscalls and
+# time per run with test/bench, next to those of /bin/true for what a
+# fork and exec alone take.
+
+bin=$(cd "$(dirname "$0")/.." && pwd)
+# the trash is the one in the temporary $HOME
+unset XDG_DATA_HOME
+n=${1:-1000}
+
+for summary in no yes; do
+	HOME=$(mktemp -d) || exit 1
+	export HOME
+	mkdir "$HOME/files"
+	i=0
+	while [ "$i" -lt "$n" ]; do
+		echo "$i" > "$HOME/files/$i"
+		i=$((i + 1))
+	done
+	"$bin/mvtrash" "$HOME/files/0"
+	[ "$summary" = yes ] && "$bin/lstrash" -m > /dev/null
+
+	[ "$summary" = no ] && "$bin/test/bench" /bin/true "$HOME"/files/[1-9]*
+	printf 'summary %s: ' "$summary"
+	"$bin/test/bench" "$bin/mvtrash" "$HOME"/files/[1-9]*
+	rm -rf "$HOME"
+done
@@ -0,0 +1,95 @@
+/*
+ * An LD_PRELOAD shim that kills the process at the CRASH_AT-th call to one
+ * of the functions below that change the file system, counted from 0, as
+ * if it crashed or lost power right before it.  CRASH_LOG prints each
+ * step.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CRASHED 99
+
+static long nsteps;
+static long crashat = -2;
+
+static void
+step(const char *name)
+{
+	if (crashat == -2) {
+		const char *env = getenv("CRASH_AT");
+		crashat = env ? atol(env) : -1;
+	}
+
+	if (getenv("CRASH_LOG")) {
+		char buf[64];
+		int len = snprintf(buf, sizeof(buf), "step %ld %s\n", nsteps, name);
+		static ssize_t (*realwrite)(int, const void *, size_t);
+		if (!realwrite)
+			*(void **)&realwrite = dlsym(RTLD_NEXT, "write");
+		realwrite(STDERR_FILENO, buf, len);
+	}
+
+	if (nsteps++ == crashat)
+		_exit(CRASHED);
+}
+
+#define WRAP(ret, name, params, args) \
+	ret name params \
+	{ \
+		static ret (*real) params; \
+		if (!real) \
+			*(void **)&real = dlsym(RTLD_NEXT, #name); \
+		step(#name); \
+		return real args; \
+	}
+
+WRAP(int, linkat, (int olddirfd, const char *oldpath, int newdirfd, const char *newpath, int flags),
+		(olddirfd, oldpath, newdirfd, newpath, flags))
+WRAP(int, renameat, (int olddirfd, const char *oldpath, int newdirfd, const char *newpath),
+		(olddirfd, oldpath, newdirfd, newpath))
+WRAP(int, renameat2, (int olddirfd, const char *oldpath, int newdirfd, const char *newpath,
+			unsigned int flags), (olddirfd, oldpath, newdirfd, newpath, flags))
+WRAP(int, unlinkat, (int dirfd, const char *path, int flags), (dirfd, path, flags))
+WRAP(int, mkdirat, (int dirfd, const char *path, mode_t mode), (dirfd, path, mode))
+WRAP(ssize_t, write, (int fd, const void *buf, size_t count), (fd, buf, count))
+WRAP(int, close, (int fd), (fd))
+WRAP(int, fclose, (FILE *stream), (stream))
+WRAP(FILE *, fopen, (const char *path, const char *mode), (path, mode))
+
+int
+open(const char *path, int flags, ...)
+{
+	static int (*real)(const char *, int, ...);
+	va_list ap;
+
+	if (!real)
+		*(void **)&real = dlsym(RTLD_NEXT, "open");
+	va_start(ap, flags);
+	mode_t mode = va_arg(ap, mode_t);
+	va_end(ap);
+	step("open");
+
+	return real(path, flags, mode);
+}
+
+int
+openat(int dirfd, const char *path, int flags, ...)
+{
+	static int (*real)(int, const char *, int, ...);
+	va_list ap;
+
+	if (!real)
+		*(void **)&real = dlsym(RTLD_NEXT, "openat");
+	va_start(ap, flags);
+	mode_t mode = va_arg(ap, mode_t);
+	va_end(ap);
+	step("openat");
+
+	return real(dirfd, path, flags, mode);
+}
@@ -0,0 +1,81 @@
+#!/bin/sh
+# Kill mvtrash and untrash at every step with test/crash.so and check that
+# the trash is never left with a partial info file or a file without an
+# info file, and that the trashed file is never lost.
+
+bin=$(cd "$(dirname "$0")/.." && pwd)
+# the trash is the one in the temporary $HOME of each run
+unset XDG_DATA_HOME
+shim=$bin/test/crash.so
+status=0
+
+fail() {
+	echo "$1" >&2
+	status=1
+}
+
+# check LABEL: the invariants of the trash in $HOME, with $stray a file
+# in $Trash/files that has no info file on purpose and $trashed the name
+# the file gets in the trash
+check() {
+	trash=$HOME/.local/share/Trash
+	for info in "$trash"/info/*.trashinfo; do
+		[ -e "$info" ] || continue
+		grep -q '^DeletionDate=' "$info" || fail "$1: partial info file $info"
+	done
+	for file in "$trash"/files/*; do
+		[ -e "$file" ] || continue
+		name=$(basename "$file")
+		[ "$name" = "$stray" ] && continue
+		[ -e "$trash/info/$name.trashinfo" ] || fail "$1: no info file for $file"
+	done
+	[ -e "$HOME/a" ] || [ -e "$trash/files/$trashed" ] || fail "$1: file lost"
+}
+
+# collide is a put whose name is taken by a stray file in $Trash/files,
+# compress compresses a file that starts like gzip data and restores it
+for op in put collide restore compress; do
+	step=0
+	stray=
+	trashed=a
+	if [ "$op" = collide ]; then
+		stray=a
+		trashed=a_1
+	fi
+	while :; do
+		HOME=$(mktemp -d) || exit 1
+		export HOME
+		if [ "$op" = compress ]; then
+			{ printf '\037\213'; head -c 65536 /dev/zero; } > "$HOME/a"
+			cp "$HOME/a" "$HOME/orig"
+		else
+			echo data > "$HOME/a"
+		fi
+		if [ -n "$stray" ]; then
+			mkdir -p "$HOME/.local/share/Trash/files"
+			echo stray > "$HOME/.local/share/Trash/files/$stray"
+		fi
+		if [ "$op" = restore ]; then
+			"$bin/mvtrash" "$HOME/a" || fail "restore: cannot trash file"
+			CRASH_AT=$step LD_PRELOAD=$shim "$bin/untrash" a > /dev/null
+		elif [ "$op" = compress ]; then
+			"$bin/mvtrash" "$HOME/a" || fail "compress: cannot trash file"
+			CRASH_AT=$step LD_PRELOAD=$shim "$bin/rmtrash" -z 0 > /dev/null
+		else
+			CRASH_AT=$step LD_PRELOAD=$shim "$bin/mvtrash" "$HOME/a"
+		fi
+		ret=$?
+		check "$op crash at step $step"
+		if [ "$op" = compress ]; then
+			"$bin/untrash" a > /dev/null && cmp -s "$HOME/a" "$HOME/orig" ||
+				fail "compress crash at step $step: file not restored as it was"
+		fi
+		rm -rf "$HOME"
+		[ "$ret" -eq 99 ] || break
+		step=$((step + 1))
+	done
+	[ "$ret" -eq 0 ] || fail "$op: exited with $ret"
+	echo "$op: killed at each of $step steps"
+done
+
+exit $status
@@ -0,0 +1,83 @@
+/*
+ * Check the DeletionDate codec against localtime_r/strftime and mktime in
+ * the time zone set by TZ, every 3599 seconds from 1963 to 2036 so every
+ * transition is crossed at all minutes and hours.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../date.h"
+
+#define START (-220000000)
+#define END 2100000000
+#define STEP 3599
+
+static int
+checkinvalid(void)
+{
+	const char *invalid[] = {
+		"", "2024-01-01", "2024-01-01 10:00:00", "2024-13-01T10:00:00",
+		"2024-01-32T10:00:00", "2024-01-01T24:00:00", "2024-01-01T10:60:00",
+		"2024-1-01T10:00:00", "20x4-01-01T10:00:00",
+	};
+	int nfailed = 0;
+
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(*invalid); i++) {
+		if (isdate(invalid[i]) || strtotime(invalid[i]) != -1) {
+			fprintf(stderr, "accepted invalid date '%s'\n", invalid[i]);
+			nfailed++;
+		}
+	}
+
+	return nfailed;
+}
+
+int
+main(void)
+{
+	const char *tz = getenv("TZ");
+	int nfailed = checkinvalid();
+	long n = 0;
+
+	tzset();
+	for (time_t t = START; t < END; t += STEP, n++) {
+		struct tm tm;
+		char want[DATELEN], got[DATELEN];
+
+		localtime_r(&t, &tm);
+		strftime(want, sizeof(want), "%Y-%m-%dT%H:%M:%S", &tm);
+		timetostr(t, got);
+		if (strcmp(want, got) != 0) {
+			fprintf(stderr, "%s: timetostr(%lld) = %s, want %s\n",
+					tz, (long long)t, got, want);
+			nfailed++;
+		}
+
+		if (!isdate(want)) {
+			fprintf(stderr, "%s: isdate(%s) = 0\n", tz, want);
+			nfailed++;
+		}
+
+		tm.tm_isdst = -1;
+		time_t wantt = mktime(&tm);
+		time_t gott = strtotime(want);
+		if (gott != wantt) {
+			fprintf(stderr, "%s: strtotime(%s) = %lld, want %lld\n",
+					tz, want, (long long)gott, (long long)wantt);
+			nfailed++;
+		}
+
+		if (nfailed > 20)
+			break;
+	}
+
+	if (nfailed) {
+		fprintf(stderr, "%s: %d failures\n", tz, nfailed);
+		return EXIT_FAILURE;
+	}
+	printf("%s: %ld dates ok\n", tz, n);
+
+	return EXIT_SUCCESS;
+}
@@ -1,30 +1,111 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <linux/limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
-#define __USE_XOPEN
 #include <time.h>
 #include <unistd.h>
 
+#include "date.h"
+#include "gzip.h"
+#include "hash.h"
+#include "summary.h"
+#include "tar.h"
 #include "util.h"
 #include "trash.h"
 
+/* large files are truncated this much at a time by a throttled purge */
+#define PURGECHUNK (64 << 20)
+/* length of the "PID.N" names of files in $Trash/staging */
+#define STAGENAMELEN (2 * 3 * sizeof(long) + 2)
+
+/* how the file of an entry is stored, as named by its X-Compressed key */
+enum { PLAIN, GZIP, TARGZIP, INCOMPRESSIBLE };
+/* what its X-Checksum key records */
+enum { NOCHECKSUM, CRC32C, MANIFEST };
+
 struct trashent {
+	Trash *trash;
+	/* decoded from encoded_deletedfilepath on first use by getdeletedfilepath() */
 	char *deletedfilepath;
+	/* the Path key of its info file, NULL for a new entry */
+	char *encoded_deletedfilepath;
 	time_t deletiontime;
+	/* disk usage in bytes, -1 if unknown */
+	long long size;
+	/* modification time of the deleted file if it was recorded, else UTIME_OMIT */
+	struct timespec mtime;
+	int compressed;
+	/* the CRC32C and length of the compressed file, -1 if not recorded */
+	uint32_t compressedcrc;
+	long long compressedlength;
+	int checksum;
+	/* the CRC32C and length of a regular file, for CRC32C */
+	uint32_t crc;
+	long long length;
 	char *infofilepath;
 	char *filesfilepath;
+	/* basenames in $Trash/info and $Trash/files, point into the paths above */
+	char *infofilename;
+	char *filesfilename;
+};
+
+/* an entry entering (sign 1) or leaving (sign -1) the trash, for its summary */
+struct summarychange {
+	time_t deletiontime;
+	long long size;
+	const char *deletedfilepath;
+	int sign;
+};
+
+/*
+ * the directories of an extracted tree, which are made writable until
+ * their members are in, with their paths relative to its top
+ */
+struct extracteddir {
+	char *path;
+	mode_t mode;
+	struct timespec mtime;
+};
+
+struct extracteddirs {
+	struct extracteddir *dirs;
+	size_t len;
 };
 
 struct trash {
-	DIR *trashdir;
+	int trashfd;
+	/* $Trash/info as read by readTrash(), opened on first use */
 	DIR *infodir;
+	int filesfd;
+	int infofd;
+	int expungedfd;
+	int dedupfd;
+	int checksumsfd;
+	int stagingfd;
+	/* whether put files are deduplicated */
+	int dedup;
+	/* whether put files get checksums and restored ones are verified */
+	int checksum;
+	int verify;
+	struct bucket bytebucket;
+	struct bucket opbucket;
+	/* whether $Trash/summary exists, -1 if not known yet */
+	int hassummary;
+	/* whether puts hold the entries locked until closetrash() */
+	int putlocked;
 	char *trashdirpath;
 	char *filesdirpath;
 	char *infodirpath;
@@ -33,15 +114,20 @@ struct trash {
 
 /* function declarations */
 struct trashent *createtrashent(Trash *trash, const char *trashedfilename, time_t deletiontime);
+void setnametrashent(struct trashent *trashent, const char *trashedfilename);
 void freetrashent(struct trashent *trashent);
 void committrashent(struct trashent *trashent);
 void deletetrashent(struct trashent *trashent);
 void restoretrashent(struct trashent *trashent);
-struct trashent *readinfofile(const char *infofilepath);
+struct trashent *readinfofile(Trash *trash, const char *infofilename);
 void asserttrash(Trash *trash);
 Trash *createtrash(const char *path);
 void rewindtrash(Trash *trash);
 struct trashent *readTrash(Trash *trash);
+static void extractmember(int dirfd, int fd, struct tarhdr *hdr, const char *path);
+static void adddir(struct extracteddirs *dirs, const char *path, struct tarhdr *hdr);
+static void setdirs(int rootfd, struct extracteddirs *dirs);
+static int issafepath(const char *path);
 
 
 /* function implementations */
@@ -50,435 +136,2728 @@ createtrashent(Trash* trash, const char *trashedfilename, time_t deletiontime)
 {
 	struct trashent *trashent = xmalloc(sizeof(*trashent));
 
+	trashent->trash = trash;
 	trashent->deletiontime = deletiontime;
+	trashent->size = -1;
+	trashent->mtime.tv_sec = 0;
+	trashent->mtime.tv_nsec = UTIME_OMIT;
+	trashent->compressed = PLAIN;
+	trashent->compressedcrc = 0;
+	trashent->compressedlength = -1;
+	trashent->checksum = NOCHECKSUM;
+	trashent->crc = 0;
+	trashent->length = -1;
 	trashent->deletedfilepath = NULL;
-	if (trashedfilename == NULL) {
-		trashent->infofilepath = NULL;
-		trashent->filesfilepath = NULL;
-	} else {
-		/*
-		 * Create in an atomic fashion an empty file in $Trash/files,
-		 * That file's filename is based on the trashedfilename parameter.
-		 */
-		char trashfilesfilepath[PATH_MAX];
-		char trashinfofilepath[PATH_MAX];
-
-		sprintf(trashfilesfilepath, "%s/%s", trash->filesdirpath, trashedfilename);
-		sprintf(trashinfofilepath, "%s/%s.trashinfo", trash->infodirpath, trashedfilename);
-
-		int i = 1;
-		errno = 0;
-		int fd = open(trashinfofilepath, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-		while (fd < 0 && errno == EEXIST) {
-			unsigned long trashfilesfilepathlen = strlen(trashfilesfilepath);
-			unsigned long trashinfofilepathlen = strlen(trashinfofilepath);
+	trashent->encoded_deletedfilepath = NULL;
+	trashent->infofilepath = NULL;
+	trashent->filesfilepath = NULL;
+	trashent->infofilename = NULL;
+	trashent->filesfilename = NULL;
+	if (trashedfilename != NULL)
+		setnametrashent(trashent, trashedfilename);
 
-			sprintf(trashfilesfilepath + trashfilesfilepathlen, "_%d", i);
-
-			trashinfofilepath[trashinfofilepathlen - strlen(".trashinfo")] = '\0';
-			trashinfofilepathlen = strlen(trashinfofilepath);
-			sprintf(trashinfofilepath + trashinfofilepathlen, "_%d.trashinfo", i);
+	return trashent;
+}
 
-			if (strlen(trashinfofilepath) >= PATH_MAX)
-				die("file name is too long");
+/*
+ * Set the name of trashent in $Trash/files to trashedfilename and its
+ * info file to trashedfilename.trashinfo.
+ */
+void
+setnametrashent(struct trashent *trashent, const char *trashedfilename)
+{
+	Trash *trash = trashent->trash;
+	unsigned long namelen = strlen(trashedfilename);
+	unsigned long filesdirpathlen = strlen(trash->filesdirpath);
+	unsigned long infodirpathlen = strlen(trash->infodirpath);
 
-			i++;
+	if (filesdirpathlen + 1 + namelen >= PATH_MAX ||
+			infodirpathlen + 1 + namelen + strlen(".trashinfo") >= PATH_MAX)
+		die("file name is too long");
 
-			fd = open(trashinfofilepath, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-		}
+	free(trashent->filesfilepath);
+	free(trashent->infofilepath);
 
-		if (fd < -1)
-			die("trash: cannot trash file %s:", trashfilesfilepath);
+	trashent->filesfilepath = xmalloc((filesdirpathlen + 1 + namelen + 1)
+								* sizeof(*trashent->filesfilepath));
+	trashent->infofilepath = xmalloc((infodirpathlen + 1 + namelen
+								+ strlen(".trashinfo") + 1)
+							   * sizeof(*trashent->infofilepath));
 
-		if (close(fd) < 0)
-			die("close:");
+	sprintf(trashent->filesfilepath, "%s/%s", trash->filesdirpath, trashedfilename);
+	sprintf(trashent->infofilepath, "%s/%s.trashinfo", trash->infodirpath, trashedfilename);
 
-		trashent->filesfilepath = xmalloc((strlen(trashfilesfilepath) + 1)
-									* sizeof(*trashent->filesfilepath));
-		trashent->infofilepath = xmalloc((strlen(trashinfofilepath) + 1)
-								   * sizeof(*trashent->infofilepath));
+	trashent->filesfilename = trashent->filesfilepath + filesdirpathlen + 1;
+	trashent->infofilename = trashent->infofilepath + infodirpathlen + 1;
+}
 
-		strcpy(trashent->filesfilepath, trashfilesfilepath);
-		strcpy(trashent->infofilepath, trashinfofilepath);
-	}
+/*
+ * Return the path trashent was deleted from.  Entries read from the trash
+ * only decode it when it's needed, most are just matched by name.
+ */
+static char *
+getdeletedfilepath(struct trashent *trashent)
+{
+	if (!trashent->deletedfilepath)
+		trashent->deletedfilepath = fullpath_decode(trashent->encoded_deletedfilepath);
 
-	return trashent;
+	return trashent->deletedfilepath;
 }
 
 void freetrashent(struct trashent *trashent)
 {
 	free(trashent->deletedfilepath);
+	free(trashent->encoded_deletedfilepath);
 	free(trashent->infofilepath);
 	free(trashent->filesfilepath);
 
 	free(trashent);
 }
 
-void
-deletetrashent(struct trashent *trashent)
+/*
+ * Open $Trash/name into *fd unless it's already open.  The directory is
+ * only created when create is set and it doesn't exist yet, return -1 if
+ * it doesn't.
+ */
+static int
+opentrashsubdir(Trash *trash, const char *name, int *fd, int create)
 {
-	if (remove(trashent->filesfilepath) < 0) {
-		if (errno == ENOTEMPTY || errno == EEXIST)
-			remove_directory(trashent->filesfilepath);
-		else if (errno != ENOENT)
-			die("remove:");
+	if (*fd >= 0)
+		return *fd;
+
+	*fd = openat(trash->trashfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (*fd < 0 && errno == ENOENT && create) {
+		if (mkdirat(trash->trashfd, name, S_IRWXU) < 0 && errno != EEXIST)
+			die("mkdir '%s/%s':", trash->trashdirpath, name);
+		*fd = openat(trash->trashfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 	}
+	if (*fd < 0 && (create || errno != ENOENT))
+		die("open: cannot open directory '%s/%s':", trash->trashdirpath, name);
 
-	if (remove(trashent->infofilepath) < 0)
-		die("remove: cannot remove file '%s':", trashent->infofilepath);
+	return *fd;
 }
 
-void
-restoretrashent(struct trashent *trashent)
+/*
+ * Lock $Trash/info with op.  Changes take it shared while an entry has an
+ * info file without its file, trashcheck() exclusively to repair.  Once
+ * puts hold it, see committrashent(), it stays shared.
+ */
+static void
+lockentries(Trash *trash, int op)
 {
-	if (file_exists(trashent->deletedfilepath))
-		die("Refusing to overwite existing file '%s'", trashent->deletedfilepath);
-
-	if (rename(trashent->filesfilepath, trashent->deletedfilepath) < 0)
-		die("cannot restore '%s':", trashent->filesfilepath);
+	if (trash->putlocked && op != LOCK_EX)
+		return;
+	if (flock(trash->infofd, op) < 0)
+		die("flock:");
+	/* the summary may be built once they're unlocked */
+	if (op == LOCK_UN && trash->hassummary == 0)
+		trash->hassummary = -1;
 }
 
-time_t
-strtotime(char *str)
+/*
+ * Remove name in dirfd and everything below it, paced by the buckets set
+ * with trashthrottle().  When throttled, large files are truncated a chunk
+ * at a time first so no single operation frees a huge extent at once.
+ */
+static void
+purgeat(Trash *trash, int dirfd, const char *name)
 {
-	struct tm tp = (struct tm){0};
-	strptime(str, "%Y-%m-%dT%H:%M:%S", &tp);
-	return mktime(&tp);
+	struct stat statbuf;
+
+	if (fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+		if (errno == ENOENT)
+			return;
+		die("stat: cannot stat '%s':", name);
+	}
+
+	if (S_ISDIR(statbuf.st_mode)) {
+		/* a tree may have directories that can't be emptied as they are */
+		if ((statbuf.st_mode & S_IRWXU) != S_IRWXU)
+			fchmodat(dirfd, name, (statbuf.st_mode & 07777) | S_IRWXU, 0);
+		int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0)
+			die("open: cannot open directory '%s':", name);
+		DIR *dirp = fdopendir(fd);
+		if (!dirp)
+			die("fdopendir:");
+
+		struct dirent *dp;
+		errno = 0;
+		while ((dp = readdir(dirp)) != NULL) {
+			if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+				continue;
+
+			purgeat(trash, fd, dp->d_name);
+			errno = 0;
+		}
+		if (errno != 0)
+			die("readdir:");
+		closedir(dirp);
+
+		bucketwait(&trash->opbucket, 1);
+		if (unlinkat(dirfd, name, AT_REMOVEDIR) < 0 && errno != ENOENT)
+			die("remove: cannot remove directory '%s':", name);
+		return;
+	}
+
+	off_t size = statbuf.st_blocks * 512;
+	int fd;
+	if (trash->bytebucket.rate > 0 && size > PURGECHUNK &&
+			S_ISREG(statbuf.st_mode) && statbuf.st_nlink == 1 &&
+			(fd = openat(dirfd, name, O_WRONLY | O_NOFOLLOW | O_CLOEXEC)) >= 0) {
+		for (off_t len = statbuf.st_size; len > PURGECHUNK; len -= PURGECHUNK) {
+			bucketwait(&trash->bytebucket, PURGECHUNK);
+			bucketwait(&trash->opbucket, 1);
+			if (ftruncate(fd, len - PURGECHUNK) < 0)
+				die("ftruncate: cannot truncate '%s':", name);
+			size -= PURGECHUNK;
+		}
+		close(fd);
+	}
+
+	if (size > 0)
+		bucketwait(&trash->bytebucket, size);
+	bucketwait(&trash->opbucket, 1);
+	if (unlinkat(dirfd, name, 0) < 0 && errno != ENOENT)
+		die("remove: cannot remove file '%s':", name);
 }
 
-char *
-timetostr(time_t time)
+/*
+ * Files are written in $Trash/staging before they're moved into place,
+ * under "PID.N" names no entry can take.  Set name to a new one.
+ */
+static void
+stage(Trash *trash, char name[STAGENAMELEN])
 {
+	static unsigned long nstaged;
 
-	int buflen = 1024;
-	char buf[buflen + 1];
-	size_t res = strftime(buf, buflen,
-					   "%Y-%m-%dT%H:%M:%S", localtime(&time));
-	if (!res)
-		die("strftime:");
-
-	char *deletiondate = xmalloc((strlen(buf) + 1) * sizeof(char)) ;
-	strcpy(deletiondate, buf);
+	opentrashsubdir(trash, "staging", &trash->stagingfd, 1);
+	sprintf(name, "%ld.%lu", (long)getpid(),
+			__atomic_fetch_add(&nstaged, 1, __ATOMIC_RELAXED));
+}
 
-	return deletiondate;
+/* purge what processes that are gone left in $Trash/staging */
+static void
+purgestaging(Trash *trash)
+{
+	if (opentrashsubdir(trash, "staging", &trash->stagingfd, 0) < 0)
+		return;
+
+	struct dirlist list;
+	listdir(trash->stagingfd, &list);
+	for (size_t i = 0; i < list.len; i++) {
+		long pid = strtol(list.names[i], NULL, 10);
+		if (pid != getpid() && (pid <= 0 || (kill(pid, 0) < 0 && errno == ESRCH)))
+			purgeat(trash, trash->stagingfd, list.names[i]);
+	}
+	freedirlist(&list);
 }
 
-struct trashent *
-readinfofile(const char *infofilepath)
+/* finish purges that were interrupted, $Trash/expunged holds their files */
+static void
+purgeexpunged(Trash *trash)
 {
-	if (!strendswith(infofilepath, ".trashinfo"))
-		return NULL;
+	purgestaging(trash);
 
-	struct trashent *trashent = createtrashent(NULL, NULL, -1);
-	struct stat statbuf;
+	int expungedfd = opentrashsubdir(trash, "expunged", &trash->expungedfd, 0);
+	if (expungedfd < 0)
+		return;
 
-	FILE *infofile = fopen(infofilepath, "r");
-	if (!infofile)
-		die("fopen: cannot open file '%s':", infofilepath);
+	int fd = openat(expungedfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		die("open:");
+	DIR *dirp = fdopendir(fd);
+	if (!dirp)
+		die("fdopendir:");
 
-	if (lstat(infofilepath, &statbuf) < 0)
-		die("stat:");
+	struct dirent *dp;
+	errno = 0;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+			continue;
 
-	if (!S_ISREG(statbuf.st_mode))
-		return NULL;
+		purgeat(trash, expungedfd, dp->d_name);
+		errno = 0;
+	}
+	if (errno != 0)
+		die("readdir:");
+	closedir(dirp);
+}
 
-	char *encoded_deletedfilepath = NULL;
-	char *deletiondate = NULL;
+/* Return the disk usage in bytes of name in dirfd and everything below it. */
+static long long
+diskusage(int dirfd, const char *name)
+{
+	struct stat statbuf;
 
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t nread;
-	while ((nread = getline(&line, &len, infofile)) != -1) {
-		if (strncmp(line, "Path=", strlen("Path=")) == 0) {
-			encoded_deletedfilepath = xmalloc((nread + 1) * sizeof(*encoded_deletedfilepath));
-			strcpy(encoded_deletedfilepath, line);
-		} else if (strncmp(line, "DeletionDate=",
-					strlen("DeletionDate=")) == 0) {
-			deletiondate = xmalloc((nread + 1) * sizeof(*deletiondate));
-			strcpy(deletiondate, line);
-		}
-	};
-	free(line);
-	if (fclose(infofile) == EOF)
-		die("fclose:");
+	if (fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+		return 0;
 
-	if (!encoded_deletedfilepath || !deletiondate)
-		return NULL;
+	long long size = (long long)statbuf.st_blocks * 512;
+	if (!S_ISDIR(statbuf.st_mode))
+		return size;
 
-	if (encoded_deletedfilepath[strlen(encoded_deletedfilepath) - 1] == '\n')
-		encoded_deletedfilepath[strlen(encoded_deletedfilepath) - 1] = '\0';
+	int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return size;
+	DIR *dirp = fdopendir(fd);
+	if (!dirp)
+		die("fdopendir:");
 
-	if (deletiondate[strlen(deletiondate) - 1] == '\n')
-		deletiondate[strlen(deletiondate) - 1] = '\0';
+	struct dirent *dp;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+			continue;
 
-	// Remove the prefix Path= and DeletionDate=
-	memmove(encoded_deletedfilepath,
-		 encoded_deletedfilepath + strlen("Path="),
-		 strlen(encoded_deletedfilepath) - strlen("Path=") + 1);
-	memmove(deletiondate,
-		 deletiondate + strlen("DeletionDate="),
-		 strlen(deletiondate) - strlen("DeletionDate=") + 1);
+		size += diskusage(fd, dp->d_name);
+	}
+	closedir(dirp);
 
-	char infofilepath_copy[strlen(infofilepath) + 1];
-	strcpy(infofilepath_copy, infofilepath);
-	char *infofilename = basename(infofilepath_copy);
-	char *infodirpath = dirname(infofilepath_copy);
-	char *trashdirpath = dirname(infodirpath);
+	return size;
+}
 
-	int trashfilenamelen = strlen(infofilename) - strlen(".trashinfo");
-	char trashfilename[trashfilenamelen + 1];
-	strncpy(trashfilename, infofilename, trashfilenamelen);
-	trashfilename[trashfilenamelen] = '\0';
+/*
+ * Return whether trash has a summary.  Called with the entries locked, so
+ * it isn't built meanwhile and a missing one stays missing until they're
+ * unlocked, when lockentries() forgets it.  One that's there is only ever
+ * removed by a repair, which changesummary() copes with.
+ */
+static int
+hassummary(Trash *trash)
+{
+	if (trash->hassummary < 0)
+		trash->hassummary = faccessat(trash->trashfd, "summary", F_OK, 0) == 0;
 
-	char *deletedfilepath = fullpath_decode(encoded_deletedfilepath);
-	trashent->deletedfilepath = deletedfilepath;
-	trashent->deletiontime = strtotime(deletiondate);
-	trashent->infofilepath = xmalloc((strlen(infofilepath) + 1) * sizeof(char));
-	strcpy(trashent->infofilepath, infofilepath);
-	trashent->filesfilepath = xmalloc((strlen(trashdirpath) + strlen("/files/") + trashfilenamelen + 1) * sizeof(char));
-	sprintf(trashent->filesfilepath, "%s%s%s", trashdirpath, "/files/", trashfilename);
+	return trash->hassummary;
+}
 
-	free(deletiondate);
-	free(encoded_deletedfilepath);
+/*
+ * Apply the nchanges changes to the summary in trashfd, if it has one,
+ * locked on lockfd, trashfd or another fd of the same directory.  flock()
+ * doesn't keep apart threads sharing an fd, so they lock on fds of their
+ * own.
+ */
+static void
+changesummary(int trashfd, int lockfd, struct summarychange *changes, size_t nchanges)
+{
+	if (flock(lockfd, LOCK_EX) < 0)
+		die("flock:");
+
+	struct summary *summary = readsummary(trashfd);
+	if (summary) {
+		for (size_t i = 0; i < nchanges; i++)
+			summaryadd(summary, changes[i].deletiontime, changes[i].size,
+					changes[i].deletedfilepath, changes[i].sign);
+		writesummary(summary, trashfd);
+		freesummary(summary);
+	}
 
-	return trashent;
+	if (flock(lockfd, LOCK_UN) < 0)
+		die("flock:");
 }
 
-void
-committrashent(struct trashent *trashent)
+/*
+ * Find the disk usage of the file of trashent, name in dirfd, if it isn't
+ * known yet and the trash has a summary to keep up to date.
+ */
+static void
+sizetrashent(struct trashent *trashent, int dirfd, const char *name)
 {
-	FILE *trashinfofile = fopen(trashent->infofilepath, "w");
-	if (!trashinfofile)
-		die("fopen: cannot open '%s':", trashent->infofilepath);
+	if (trashent->size < 0 && hassummary(trashent->trash))
+		trashent->size = diskusage(dirfd, name);
+}
 
+/*
+ * Record trashent entering (sign 1) or leaving (sign -1) the trash in its
+ * summary, if it has one.  dirfd and name locate the file when its size
+ * isn't known yet.  Called with the entries locked once the change is
+ * made, so the summary is either built after the change or was there
+ * before it, and the change is written before anything else happens.
+ */
+static void
+updatesummary(struct trashent *trashent, int dirfd, const char *name, int sign)
+{
+	Trash *trash = trashent->trash;
 
-	char *encoded_deletedfilepath = fullpath_encode(trashent->deletedfilepath);
-	char *deletiondate = timetostr(trashent->deletiontime);
-	int result = fprintf(trashinfofile,
-					  "[Trash Info]\n"
-					  "Path=%s\n"
-					  "DeletionDate=%s\n",
-					  encoded_deletedfilepath, deletiondate);
-	if (result < 0)
-		die("fprintf:");
-
-	if (rename(trashent->deletedfilepath, trashent->filesfilepath) < 0)
-		die("cannot trash '%s':", trashent->deletedfilepath);
+	if (!hassummary(trash))
+		return;
 
-	if (fclose(trashinfofile) == EOF)
-		die("fclose:");
-	free(deletiondate);
-	free(encoded_deletedfilepath);
+	sizetrashent(trashent, dirfd, name);
+	struct summarychange change = {
+		trashent->deletiontime, trashent->size, getdeletedfilepath(trashent), sign
+	};
+	changesummary(trash->trashfd, trash->trashfd, &change, 1);
 }
 
-void
-asserttrash(Trash *trash)
-{
-	assert(trash != NULL);
+/*
+ * Regular files in $Trash/files can share their data through hardlinks.
+ * $Trash/dedup/SIZE lists the files of SIZE bytes, one per line as
+ * "HASH INODE NAME" with the name URI encoded and HASH "-" until a file of
+ * the same size needs it, so a put only reads and hashes the files it may
+ * be a copy of.  Lines whose file is gone or was replaced are dropped.
+ */
+struct dedupent {
+	char *name;
+	struct stat statbuf;
+	int hashed;
+	uint64_t hash;
+};
+
+struct dedupbucket {
+	off_t size;
+	struct dedupent *ents;
+	size_t len;
+};
 
-	assert(trash->trashdir != NULL);
-	assert(trash->infodir != NULL);
+static struct dedupent *
+addbucket(struct dedupbucket *bucket, const char *name, struct stat *statbuf)
+{
+	bucket->ents = realloc(bucket->ents, (bucket->len + 1) * sizeof(*bucket->ents));
+	if (!bucket->ents)
+		die("realloc:");
+
+	struct dedupent *ent = &bucket->ents[bucket->len++];
+	ent->name = xmalloc(strlen(name) + 1);
+	strcpy(ent->name, name);
+	ent->statbuf = *statbuf;
+	ent->hashed = 0;
+	ent->hash = 0;
+
+	return ent;
+}
 
-	assert(trash->trashdir != NULL);
-	assert(trash->filesdirpath != NULL);
-	assert(trash->infodirpath != NULL);
+static void
+freebucket(struct dedupbucket *bucket)
+{
+	for (size_t i = 0; i < bucket->len; i++)
+		free(bucket->ents[i].name);
+	free(bucket->ents);
 }
 
-Trash *
-createtrash(const char *trashpath)
+/* Read the files of size bytes still in $Trash/files from their bucket. */
+static void
+readbucket(Trash *trash, off_t size, struct dedupbucket *bucket)
 {
-	assert(trashpath != NULL);
+	bucket->size = size;
+	bucket->ents = NULL;
+	bucket->len = 0;
 
-	Trash *trash = xmalloc(sizeof(*trash));
+	if (opentrashsubdir(trash, "dedup", &trash->dedupfd, 0) < 0)
+		return;
 
-	int trashpathlen = strlen(trashpath);
-	trash->trashdirpath = xmalloc(trashpathlen + 1);
-	trash->filesdirpath = xmalloc(
-			(trashpathlen + strlen("/files") + 1) * sizeof(char));
-	trash->infodirpath = xmalloc(
-			(trashpathlen + strlen("/info") + 1) * sizeof(char));
+	char bucketname[3 * sizeof(long long) + 1];
+	sprintf(bucketname, "%lld", (long long)size);
 
-	strcpy(trash->trashdirpath, trashpath);
-	sprintf(trash->filesdirpath, "%s%s", trashpath, "/files");
-	sprintf(trash->infodirpath, "%s%s", trashpath, "/info");
+	int fd = openat(trash->dedupfd, bucketname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return;
+		die("open: cannot open dedup index:");
+	}
 
-	xmkdir(trash->filesdirpath);
-	xmkdir(trash->infodirpath);
+	FILE *file = fdopen(fd, "r");
+	if (!file)
+		die("fdopen:");
 
-	trash->trashdir = opendir(trash->trashdirpath);
-	if (!trash->trashdir)
-		die("opendir: cannot open directory '%s':", trashpath);
-	trash->infodir = opendir(trash->infodirpath);
-	if (!trash->infodir)
-		die("opendir: cannot open directory '%s':", trash->infodir);
+	char *line = NULL;
+	size_t len = 0;
+	while (getline(&line, &len, file) != -1) {
+		char hash[strlen(line) + 1], name[strlen(line) + 1];
+		unsigned long long ino;
 
-	return trash;
+		if (sscanf(line, "%s %llu %s", hash, &ino, name) != 3)
+			continue;
+
+		char *decoded = uri_decode(name);
+		struct stat statbuf;
+		if (fstatat(trash->filesfd, decoded, &statbuf, AT_SYMLINK_NOFOLLOW) == 0 &&
+				S_ISREG(statbuf.st_mode) && statbuf.st_size == size) {
+			struct dedupent *ent = addbucket(bucket, decoded, &statbuf);
+			if (strcmp(hash, "-") != 0 && ino == statbuf.st_ino) {
+				ent->hashed = 1;
+				ent->hash = strtoull(hash, NULL, 16);
+			}
+		}
+		free(decoded);
+	}
+	free(line);
+	if (fclose(file) == EOF)
+		die("fclose:");
 }
 
-/*
- * trashpath is /path/to/trash/directory.
- * If trashpath is NULL use the home trash directory (e.g. XDG_DATA_HOME/Trash).
- */
-Trash *
-opentrash(const char *trashpath)
+/* Replace the bucket in $Trash/dedup, the caller holds the trash lock. */
+static void
+writebucket(Trash *trash, struct dedupbucket *bucket)
 {
-	Trash *trash;
-	if (!trashpath) {
-		char hometrash[PATH_MAX + 1];
-		const char *home = xgetenv("HOME", NULL);
-		if (!home)
-			die("HOME is not set");
+	opentrashsubdir(trash, "dedup", &trash->dedupfd, 1);
 
-		char defaultxdgdata[strlen(home) + strlen("/.local/share") + 1];
-		sprintf(defaultxdgdata, "%s%s", home, "/.local/share");
+	char bucketname[3 * sizeof(long long) + 1];
+	sprintf(bucketname, "%lld", (long long)bucket->size);
 
-		sprintf(hometrash, "%s/Trash", xgetenv("XDG_DATA_HOME", defaultxdgdata));
-		trash = createtrash(hometrash);
-		return trash;
+	if (bucket->len == 0) {
+		if (unlinkat(trash->dedupfd, bucketname, 0) < 0 && errno != ENOENT)
+			die("remove: cannot remove dedup index:");
+		return;
 	}
 
-	trash = createtrash(trashpath);
-	return trash;
-}
+	char tmpname[STAGENAMELEN];
+	stage(trash, tmpname);
+	int fd = openat(trash->stagingfd, tmpname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+			S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		die("open: cannot write dedup index:");
+
+	FILE *file = fdopen(fd, "w");
+	if (!file)
+		die("fdopen:");
+
+	for (size_t i = 0; i < bucket->len; i++) {
+		struct dedupent *ent = &bucket->ents[i];
+		char *encoded = uri_encode(ent->name);
+		if (ent->hashed)
+			fprintf(file, "%016llx", (unsigned long long)ent->hash);
+		else
+			fputc('-', file);
+		fprintf(file, " %llu %s\n", (unsigned long long)ent->statbuf.st_ino, encoded);
+		free(encoded);
+	}
 
-void
-closetrash(Trash *trash)
-{
-	asserttrash(trash);
+	if (fclose(file) == EOF)
+		die("fclose: cannot write dedup index:");
 
-	if (closedir(trash->trashdir) < 0)
-		die("closedir:");
+	if (renameat(trash->stagingfd, tmpname, trash->dedupfd, bucketname) < 0)
+		die("rename: cannot write dedup index:");
+}
 
-	if (closedir(trash->infodir) < 0)
-		die("closedir:");
+static int
+hashdedupent(Trash *trash, struct dedupent *ent)
+{
+	if (ent->hashed)
+		return 0;
+
+	int fd = openat(trash->filesfd, ent->name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0 || hashfile(fd, ent->statbuf.st_size, &ent->hash) < 0) {
+		warn("cannot hash '%s/%s':", trash->filesdirpath, ent->name);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+	ent->hashed = 1;
 
-	free(trash->trashdirpath);
-	free(trash->infodirpath);
-	free(trash->filesdirpath);
-	free(trash);
+	return 0;
 }
 
-void
-rewindtrash(Trash *trash)
+/* Return whether the size bytes of name1 and name2 in $Trash/files are the same. */
+static int
+samecontents(Trash *trash, const char *name1, const char *name2, off_t size)
 {
-	asserttrash(trash);
-	rewinddir(trash->infodir);
+	int same = 0;
+	void *p1 = MAP_FAILED, *p2 = MAP_FAILED;
+
+	int fd1 = openat(trash->filesfd, name1, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	int fd2 = openat(trash->filesfd, name2, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd1 >= 0 && fd2 >= 0 &&
+			(p1 = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd1, 0)) != MAP_FAILED &&
+			(p2 = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd2, 0)) != MAP_FAILED) {
+		madvise(p1, size, MADV_SEQUENTIAL);
+		madvise(p2, size, MADV_SEQUENTIAL);
+		same = memcmp(p1, p2, size) == 0;
+	}
+
+	if (p1 != MAP_FAILED)
+		munmap(p1, size);
+	if (p2 != MAP_FAILED)
+		munmap(p2, size);
+	if (fd1 >= 0)
+		close(fd1);
+	if (fd2 >= 0)
+		close(fd2);
+
+	return same;
 }
 
-struct trashent *
-readTrash(Trash *trash)
+/*
+ * Rewrite $Trash/info/infofilename with the "KEY=VALUE" lines in keys
+ * added, in place of any lines it had for those keys.  The new contents
+ * are written in $Trash/staging and renamed over it.  Return -1 if there
+ * is no info file.
+ */
+static int
+setinfokeys(Trash *trash, const char *infofilename, char **keys, size_t nkeys)
 {
-	asserttrash(trash);
-	struct trashent *trashent;
-	struct dirent *dp = NULL;
+	int fd = openat(trash->infofd, infofilename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	FILE *in = fdopen(fd, "r");
+	if (!in)
+		die("fdopen:");
+
+	char tmpname[STAGENAMELEN];
+	stage(trash, tmpname);
+	fd = openat(trash->stagingfd, tmpname, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+			S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		die("open: cannot create '%s/staging/%s':", trash->trashdirpath, tmpname);
+	FILE *out = fdopen(fd, "w");
+	if (!out)
+		die("fdopen:");
 
-	errno = 0;
-	while ((dp = readdir(trash->infodir)) != NULL) {
-		if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t nread;
+	while ((nread = getline(&line, &len, in)) != -1) {
+		size_t i;
+		for (i = 0; i < nkeys; i++) {
+			size_t keylen = strcspn(keys[i], "=") + 1;
+			if (strncmp(line, keys[i], keylen) == 0)
+				break;
+		}
+		if (i < nkeys)
 			continue;
+		fputs(line, out);
+		if (line[nread - 1] != '\n')
+			fputc('\n', out);
+	}
+	free(line);
+	fclose(in);
 
-		if (!strendswith(dp->d_name, ".trashinfo"))
-			continue;
+	for (size_t i = 0; i < nkeys; i++)
+		fprintf(out, "%s\n", keys[i]);
+	if (fclose(out) == EOF)
+		die("fclose: cannot write '%s/staging/%s':", trash->trashdirpath, tmpname);
 
-		int infofilepathlen = strlen(trash->infodirpath) + 1 + strlen(dp->d_name);
-		char infofilepath[infofilepathlen + 1];
-		sprintf(infofilepath, "%s/%s", trash->infodirpath, dp->d_name);
+	if (renameat(trash->stagingfd, tmpname, trash->infofd, infofilename) < 0)
+		die("rename: cannot update '%s/%s':", trash->infodirpath, infofilename);
 
-		errno = 0;
-		trashent = readinfofile(infofilepath);
-		if (!trashent) {
-			if (errno != 0)
-				die("readinfofile:");
-			else
-				die("readinfofile");
-		}
+	return 0;
+}
+
+/*
+ * Replace dup in $Trash/files with a hardlink to canonical, made in
+ * $Trash/staging and renamed over it.  Its modification time is recorded
+ * in its info file first, unless an earlier deduplication already did, so
+ * it can be restored with the original one.
+ * Return -1 if dup has no info file.
+ */
+static int
+linkdup(Trash *trash, struct dedupent *dup, struct dedupent *canonical)
+{
+	char infofilename[strlen(dup->name) + strlen(".trashinfo") + 1];
+	sprintf(infofilename, "%s.trashinfo", dup->name);
+
+	struct trashent *trashent = readinfofile(trash, infofilename);
+	if (!trashent)
+		return -1;
+	int hasmtime = trashent->mtime.tv_nsec != UTIME_OMIT;
+	freetrashent(trashent);
 
-		break;
+	if (!hasmtime) {
+		char mtime[strlen("X-Mtime=.") + 3 * sizeof(long long) + 9 + 1];
+		sprintf(mtime, "X-Mtime=%lld.%09ld",
+				(long long)dup->statbuf.st_mtim.tv_sec, dup->statbuf.st_mtim.tv_nsec);
+		char *keys[] = { mtime };
+		if (setinfokeys(trash, infofilename, keys, 1) < 0)
+			return -1;
 	}
 
-	if (dp == NULL && errno != 0)
-		die("readir:");
+	char linkname[STAGENAMELEN];
+	stage(trash, linkname);
+	if (linkat(trash->filesfd, canonical->name, trash->stagingfd, linkname, 0) < 0)
+		die("link: cannot link '%s/%s':", trash->filesdirpath, canonical->name);
+	if (renameat(trash->stagingfd, linkname, trash->filesfd, dup->name) < 0)
+		die("rename: cannot replace '%s/%s':", trash->filesdirpath, dup->name);
 
-	return dp != NULL ? trashent : NULL;
+	return 0;
 }
 
-int
-istrashablepath(Trash *trash, const char *path)
+/* Return how many files in bucket are the inode ino. */
+static nlink_t
+countlinks(struct dedupbucket *bucket, ino_t ino)
 {
-	char fullpath[PATH_MAX];
-	if (!realpath(path, fullpath))
-		die("realpath:");
+	nlink_t n = 0;
+	for (size_t i = 0; i < bucket->len; i++)
+		n += bucket->ents[i].statbuf.st_ino == ino;
 
-	return (
-		strncmp(trash->trashdirpath, fullpath, strlen(fullpath)) &&
-		strcmp(trash->filesdirpath, fullpath) &&
-		strcmp(trash->infodirpath, fullpath)
-	);
+	return n;
 }
 
-int
-trashput(Trash *trash, const char *path)
+/*
+ * Replace the i-th file in bucket with a hardlink to another with the same
+ * contents, owner and mode, return whether it was.  Only files with no
+ * other links are replaced and only files whose links are all in the
+ * bucket are linked to, so data is never shared with a file outside the
+ * trash.  Candidates are compared by hash and then byte by byte.
+ */
+static int
+dedupbucketent(Trash *trash, struct dedupbucket *bucket, size_t i)
 {
-	asserttrash(trash);
-	assert(path != NULL);
+	struct dedupent *ent = &bucket->ents[i];
 
-	if (!file_exists(path))
-		die("'%s' doesn't exit:", path);
-	// Prevent trashing a component of the trash directory path
-	if (!istrashablepath(trash, path))
-		die("cannot trash '%s'", path);
+	if (ent->statbuf.st_nlink != 1)
+		return 0;
 
+	for (size_t j = 0; j < bucket->len; j++) {
+		struct dedupent *canonical = &bucket->ents[j];
 
+		if (j == i || canonical->statbuf.st_ino == ent->statbuf.st_ino ||
+				(canonical->statbuf.st_mode & 07777) != (ent->statbuf.st_mode & 07777) ||
+				canonical->statbuf.st_uid != ent->statbuf.st_uid ||
+				canonical->statbuf.st_gid != ent->statbuf.st_gid ||
+				canonical->statbuf.st_nlink != countlinks(bucket, canonical->statbuf.st_ino))
+			continue;
 
-	char fullpath[PATH_MAX];
-	if (!realpath(path, fullpath))
-		die("realpath:");
+		if (hashdedupent(trash, ent) < 0)
+			return 0;
+		if (hashdedupent(trash, canonical) < 0 || canonical->hash != ent->hash ||
+				!samecontents(trash, ent->name, canonical->name, bucket->size))
+			continue;
 
-	char buf[PATH_MAX];
-	// Get the basename of fullpath
-	char *fullpath_copy = buf;
-	strcpy(fullpath_copy, fullpath);
+		if (linkdup(trash, ent, canonical) < 0)
+			return 0;
+
+		ino_t ino = canonical->statbuf.st_ino;
+		for (size_t k = 0; k < bucket->len; k++)
+			if (bucket->ents[k].statbuf.st_ino == ino)
+				bucket->ents[k].statbuf.st_nlink++;
+		ent->statbuf = canonical->statbuf;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Deduplicate a file just put into $Trash/files against its bucket. */
+static void
+dedupput(struct trashent *trashent)
+{
+	Trash *trash = trashent->trash;
+	struct stat statbuf;
+
+	if (fstatat(trash->filesfd, trashent->filesfilename, &statbuf, AT_SYMLINK_NOFOLLOW) < 0 ||
+			!S_ISREG(statbuf.st_mode) || statbuf.st_nlink != 1 || statbuf.st_size == 0)
+		return;
+
+	int trashfd = trash->trashfd;
+	if (flock(trashfd, LOCK_EX) < 0)
+		die("flock:");
+
+	struct dedupbucket bucket;
+	readbucket(trash, statbuf.st_size, &bucket);
+
+	/* a line left by an earlier file of the same name */
+	for (size_t i = 0; i < bucket.len; i++) {
+		if (strcmp(bucket.ents[i].name, trashent->filesfilename) == 0) {
+			free(bucket.ents[i].name);
+			bucket.ents[i--] = bucket.ents[--bucket.len];
+		}
+	}
+
+	addbucket(&bucket, trashent->filesfilename, &statbuf);
+	dedupbucketent(trash, &bucket, bucket.len - 1);
+	writebucket(trash, &bucket);
+
+	if (flock(trashfd, LOCK_UN) < 0)
+		die("flock:");
+
+	freebucket(&bucket);
+}
+
+/* Return whether the file name in $Trash/files shares its data with another entry. */
+static int
+isdeduped(Trash *trash, const char *name, struct stat *statbuf)
+{
+	if (!S_ISREG(statbuf->st_mode) || statbuf->st_nlink == 1)
+		return 0;
+
+	struct dedupbucket bucket;
+	readbucket(trash, statbuf->st_size, &bucket);
+
+	int shared = 0;
+	for (size_t i = 0; i < bucket.len && !shared; i++)
+		shared = bucket.ents[i].statbuf.st_ino == statbuf->st_ino &&
+			strcmp(bucket.ents[i].name, name) != 0;
+
+	freebucket(&bucket);
+
+	return shared;
+}
+
+/*
+ * Restore trashent by copying its file out of the trash, for files whose
+ * data is shared with other entries.  The copy is only linked into place
+ * once complete where the file system allows it.
+ */
+static void
+copyout(struct trashent *trashent, struct stat *statbuf)
+{
+	Trash *trash = trashent->trash;
+
+	int infd = openat(trash->filesfd, trashent->filesfilename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (infd < 0)
+		die("open: cannot open '%s':", trashent->filesfilepath);
+
+	char dirpath[strlen(trashent->deletedfilepath) + 1];
+	strcpy(dirpath, trashent->deletedfilepath);
+
+	int linked = 0;
+	int outfd = open(dirname(dirpath), O_TMPFILE | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (outfd < 0) {
+		if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+			die("cannot restore '%s':", trashent->deletedfilepath);
+		outfd = open(trashent->deletedfilepath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+				S_IRUSR | S_IWUSR);
+		if (outfd < 0) {
+			if (errno == EEXIST)
+				die("Refusing to overwite existing file '%s'", trashent->deletedfilepath);
+			die("cannot restore '%s':", trashent->deletedfilepath);
+		}
+		linked = 1;
+	}
+
+	for (off_t off = 0; off < statbuf->st_size; ) {
+		ssize_t n = sendfile(outfd, infd, &off, statbuf->st_size - off);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (linked)
+				unlink(trashent->deletedfilepath);
+			die("cannot restore '%s':", trashent->deletedfilepath);
+		}
+	}
+	close(infd);
+
+	if (fchmod(outfd, statbuf->st_mode & 07777) < 0)
+		die("chmod: cannot restore '%s':", trashent->deletedfilepath);
+
+	if (!linked) {
+		char procpath[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+		sprintf(procpath, "/proc/self/fd/%d", outfd);
+		if (linkat(AT_FDCWD, procpath, AT_FDCWD, trashent->deletedfilepath,
+					AT_SYMLINK_FOLLOW) < 0) {
+			if (errno == EEXIST)
+				die("Refusing to overwite existing file '%s'", trashent->deletedfilepath);
+			die("cannot restore '%s':", trashent->deletedfilepath);
+		}
+	}
+	if (close(outfd) < 0)
+		die("close:");
+
+	if (unlinkat(trash->filesfd, trashent->filesfilename, 0) < 0)
+		die("remove: cannot remove file '%s':", trashent->filesfilepath);
+}
+
+/*
+ * Entries put with checksums have the CRC32C and length of a regular file
+ * in their info file.  A directory has a manifest instead, $Trash/checksums/NAME
+ * lists the regular files below it one per line as "CRC LENGTH PATH", with
+ * PATH relative to the directory and URI encoded.  The files of a tree are
+ * checksummed in parallel.
+ */
+struct sumjob {
+	char *path;
+	uint32_t crc;
+	off_t length;
+	int failed;
+	/* what the manifest has, when verifying */
+	uint32_t wantcrc;
+	long long wantlength;
+};
+
+struct summing {
+	int dirfd;
+	struct sumjob *jobs;
+	size_t len;
+	size_t next;
+};
+
+static struct sumjob *
+addsumjob(struct summing *summing, size_t *cap, const char *path)
+{
+	if (summing->len == *cap) {
+		*cap = *cap ? 2 * *cap : 64;
+		summing->jobs = realloc(summing->jobs, *cap * sizeof(*summing->jobs));
+		if (!summing->jobs)
+			die("realloc:");
+	}
+
+	struct sumjob *job = &summing->jobs[summing->len++];
+	job->path = xmalloc(strlen(path) + 1);
+	strcpy(job->path, path);
+	job->crc = 0;
+	job->length = 0;
+	job->failed = 0;
+	job->wantcrc = 0;
+	job->wantlength = -1;
+
+	return job;
+}
+
+static void
+freesumming(struct summing *summing)
+{
+	for (size_t i = 0; i < summing->len; i++)
+		free(summing->jobs[i].path);
+	free(summing->jobs);
+}
+
+/* Add the regular files below dir, relative to summing->dirfd, to summing. */
+static void
+listtree(struct summing *summing, size_t *cap, const char *dir)
+{
+	int fd = openat(summing->dirfd, dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		die("open: cannot open directory '%s':", dir);
+
+	struct dirlist list;
+	listdir(fd, &list);
+	for (size_t i = 0; i < list.len; i++) {
+		char path[strlen(dir) + 1 + strlen(list.names[i]) + 1];
+		if (strcmp(dir, ".") == 0)
+			strcpy(path, list.names[i]);
+		else
+			sprintf(path, "%s/%s", dir, list.names[i]);
+
+		struct stat statbuf;
+		if (fstatat(fd, list.names[i], &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+			die("stat: cannot stat '%s':", path);
+		if (S_ISDIR(statbuf.st_mode))
+			listtree(summing, cap, path);
+		else if (S_ISREG(statbuf.st_mode))
+			addsumjob(summing, cap, path);
+	}
+	freedirlist(&list);
+	close(fd);
+}
+
+static void *
+sumfiles(void *arg)
+{
+	struct summing *summing = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&summing->next, 1, __ATOMIC_RELAXED)) < summing->len) {
+		struct sumjob *job = &summing->jobs[i];
+		int fd = openat(summing->dirfd, job->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		job->failed = fd < 0 || crc32cfile(fd, &job->crc, &job->length) < 0;
+		if (fd >= 0)
+			close(fd);
+	}
+
+	return NULL;
+}
+
+/* Checksum the files of summing on all processors at once. */
+static void
+sumtree(struct summing *summing)
+{
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	if ((size_t)nthreads > summing->len)
+		nthreads = summing->len;
+
+	summing->next = 0;
+	pthread_t threads[nthreads + 1];
+	for (long i = 1; i < nthreads; i++)
+		if ((errno = pthread_create(&threads[i], NULL, sumfiles, summing)) != 0)
+			die("pthread_create:");
+	sumfiles(summing);
+	for (long i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static int
+cmpsumjobs(const void *a, const void *b)
+{
+	return strcmp(((const struct sumjob *)a)->path, ((const struct sumjob *)b)->path);
+}
+
+/*
+ * Write the manifest of the directory name in $Trash/files, in
+ * $Trash/staging first so it's complete once it's in $Trash/checksums.
+ * Return -1 with a warning if it can't be.
+ */
+static int
+writemanifest(Trash *trash, const char *name)
+{
+	struct summing summing = { -1, NULL, 0, 0 };
+	size_t cap = 0;
+
+	summing.dirfd = openat(trash->filesfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (summing.dirfd < 0) {
+		warn("open: cannot open directory '%s/%s':", trash->filesdirpath, name);
+		return -1;
+	}
+	listtree(&summing, &cap, ".");
+	sumtree(&summing);
+	close(summing.dirfd);
+	qsort(summing.jobs, summing.len, sizeof(*summing.jobs), cmpsumjobs);
+
+	for (size_t i = 0; i < summing.len; i++) {
+		if (summing.jobs[i].failed) {
+			warn("cannot checksum '%s/%s/%s':", trash->filesdirpath, name,
+					summing.jobs[i].path);
+			freesumming(&summing);
+			return -1;
+		}
+	}
+
+	opentrashsubdir(trash, "checksums", &trash->checksumsfd, 1);
+	char tmpname[STAGENAMELEN];
+	stage(trash, tmpname);
+	int fd = openat(trash->stagingfd, tmpname, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+			S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		die("open: cannot write manifest of '%s/%s':", trash->filesdirpath, name);
+	FILE *file = fdopen(fd, "w");
+	if (!file)
+		die("fdopen:");
+
+	for (size_t i = 0; i < summing.len; i++) {
+		struct sumjob *job = &summing.jobs[i];
+		char *encoded = uri_encode(job->path);
+		fprintf(file, "%08x %lld %s\n", job->crc, (long long)job->length, encoded);
+		free(encoded);
+	}
+	freesumming(&summing);
+
+	if (fclose(file) == EOF ||
+			renameat(trash->stagingfd, tmpname, trash->checksumsfd, name) < 0) {
+		warn("cannot write manifest of '%s/%s':", trash->filesdirpath, name);
+		unlinkat(trash->stagingfd, tmpname, 0);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Record the checksums of a file just put into $Trash/files along with its
+ * length and modification time.  Other kinds of files have nothing to
+ * verify.  The file is already trashed, so when it can't be read it's
+ * left without checksums with a warning.
+ */
+static void
+checksumput(struct trashent *trashent)
+{
+	Trash *trash = trashent->trash;
+	struct stat statbuf;
+
+	int fd = openat(trash->filesfd, trashent->filesfilename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &statbuf) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	char *keys[3];
+	size_t nkeys = 0;
+	char checksum[strlen("X-Checksum=crc32c:") + 8 + 1];
+	char length[strlen("X-Length=") + 3 * sizeof(long long) + 1];
+	char mtime[strlen("X-Mtime=.") + 3 * sizeof(long long) + 9 + 1];
+
+	if (S_ISREG(statbuf.st_mode)) {
+		uint32_t crc;
+		off_t len;
+		if (crc32cfile(fd, &crc, &len) < 0) {
+			warn("read: cannot checksum '%s':", trashent->filesfilepath);
+			close(fd);
+			return;
+		}
+		sprintf(checksum, "X-Checksum=crc32c:%08x", crc);
+		sprintf(length, "X-Length=%lld", (long long)len);
+		keys[nkeys++] = checksum;
+		keys[nkeys++] = length;
+	} else if (S_ISDIR(statbuf.st_mode) &&
+			writemanifest(trash, trashent->filesfilename) == 0) {
+		keys[nkeys++] = "X-Checksum=manifest";
+	}
+	close(fd);
+
+	if (nkeys == 0)
+		return;
+	sprintf(mtime, "X-Mtime=%lld.%09ld",
+			(long long)statbuf.st_mtim.tv_sec, statbuf.st_mtim.tv_nsec);
+	keys[nkeys++] = mtime;
+	setinfokeys(trash, trashent->infofilename, keys, nkeys);
+}
+
+/* Drop the manifest of trashent once it leaves the trash. */
+static void
+dropmanifest(struct trashent *trashent)
+{
+	Trash *trash = trashent->trash;
+
+	if (trashent->checksum != MANIFEST ||
+			opentrashsubdir(trash, "checksums", &trash->checksumsfd, 0) < 0)
+		return;
+	if (unlinkat(trash->checksumsfd, trashent->filesfilename, 0) < 0 && errno != ENOENT)
+		die("remove: cannot remove manifest of '%s':", trashent->filesfilepath);
+}
+
+/* Compare crc and len to those recorded for the regular file of trashent. */
+static int
+matchcrc(struct trashent *trashent, uint32_t crc, off_t len)
+{
+	if (crc == trashent->crc && len == trashent->length)
+		return 0;
+
+	warn("checksum mismatch: '%s'", trashent->deletedfilepath);
+	return -1;
+}
+
+/*
+ * Check the files of the tree name in dirfd against the manifest of
+ * trashent, all of them are read and every mismatch is reported.  Files
+ * that aren't in the manifest are not checked.  Return -1 on a mismatch
+ * or if the manifest is missing.
+ */
+static int
+verifytree(struct trashent *trashent, int dirfd, const char *name)
+{
+	Trash *trash = trashent->trash;
+	FILE *file = NULL;
+
+	if (opentrashsubdir(trash, "checksums", &trash->checksumsfd, 0) >= 0) {
+		int fd = openat(trash->checksumsfd, trashent->filesfilename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd >= 0 && !(file = fdopen(fd, "r")))
+			die("fdopen:");
+	}
+	if (!file) {
+		warn("cannot verify '%s': manifest missing", trashent->deletedfilepath);
+		return -1;
+	}
+
+	struct summing summing = { -1, NULL, 0, 0 };
+	size_t cap = 0;
+
+	char *line = NULL;
+	size_t len = 0;
+	while (getline(&line, &len, file) != -1) {
+		char path[strlen(line) + 1];
+		unsigned int crc;
+		long long length;
+
+		if (sscanf(line, "%x %lld %s", &crc, &length, path) != 3)
+			continue;
+
+		char *decoded = uri_decode(path);
+		struct sumjob *job = addsumjob(&summing, &cap, decoded);
+		job->wantcrc = crc;
+		job->wantlength = length;
+		free(decoded);
+	}
+	free(line);
+	if (fclose(file) == EOF)
+		die("fclose:");
+
+	summing.dirfd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (summing.dirfd < 0)
+		die("open: cannot open directory '%s':", name);
+	sumtree(&summing);
+	close(summing.dirfd);
+
+	int status = 0;
+	for (size_t i = 0; i < summing.len; i++) {
+		struct sumjob *job = &summing.jobs[i];
+		if (job->failed) {
+			warn("cannot verify '%s/%s':", trashent->deletedfilepath, job->path);
+			status = -1;
+		} else if (job->crc != job->wantcrc || job->length != job->wantlength) {
+			warn("checksum mismatch: '%s/%s'", trashent->deletedfilepath, job->path);
+			status = -1;
+		}
+	}
+	freesumming(&summing);
+
+	return status;
+}
+
+/*
+ * Check the file name in dirfd against the checksums of trashent before it
+ * is restored.  Return -1 on a mismatch, entries put without checksums
+ * pass with a warning.
+ */
+static int
+verifyent(struct trashent *trashent, int dirfd, const char *name)
+{
+	if (trashent->checksum == MANIFEST)
+		return verifytree(trashent, dirfd, name);
+	if (trashent->checksum != CRC32C) {
+		warn("'%s' has no checksum, not verified", trashent->deletedfilepath);
+		return 0;
+	}
+
+	int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		warn("cannot verify '%s':", trashent->deletedfilepath);
+		return -1;
+	}
+	uint32_t crc;
+	off_t len;
+	int status = crc32cfile(fd, &crc, &len);
+	close(fd);
+	if (status < 0) {
+		warn("cannot verify '%s':", trashent->deletedfilepath);
+		return -1;
+	}
+
+	return matchcrc(trashent, crc, len);
+}
+
+/* a stream copied between two fds by a thread of its own */
+struct pipejob {
+	int infd;
+	int outfd;
+	/* the tree to archive, for tarthread() */
+	int dirfd;
+	const char *name;
+	int status;
+};
+
+static void *
+gunzipthread(void *arg)
+{
+	struct pipejob *job = arg;
+
+	job->status = gunzipfd(job->infd, job->outfd, NULL);
+	close(job->outfd);
+
+	return NULL;
+}
+
+/*
+ * Extract the tree archived as name from the tar stream read from fd into
+ * path in dirfd.  Its directories are added to dirs, to be set with
+ * setdirs() once the tree is in place.
+ */
+static void
+extracttree(int dirfd, int fd, const char *name, const char *path,
+		struct extracteddirs *dirs)
+{
+	struct tarhdr hdr;
+
+	while (targetheader(fd, &hdr)) {
+		size_t namelen = strlen(name);
+		const char *rest = hdr.name + namelen;
+
+		if (strncmp(hdr.name, name, namelen) == 0 && (*rest == '\0' || *rest == '/') &&
+				(*rest == '\0' || rest[1] == '\0' || issafepath(rest + 1))) {
+			char member[strlen(path) + strlen(rest) + 1];
+			sprintf(member, "%s%s", path, rest);
+			if (member[strlen(member) - 1] == '/')
+				member[strlen(member) - 1] = '\0';
+			extractmember(dirfd, fd, &hdr, member);
+			adddir(dirs, rest, &hdr);
+		} else {
+			warn("skipping unknown member '%s'", hdr.name);
+			tarskipdata(fd, hdr.size);
+		}
+
+		freetarhdr(&hdr);
+	}
+
+	/* the writer may still be sending the end of the archive */
+	char buf[BUFSIZ];
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/*
+ * Return whether the file open on fd is the compressed file of trashent.
+ * The info file is marked before the file is swapped, so an interrupted
+ * compression leaves the marked entry with its old file, which may well
+ * be gzip data itself.  Only the compressed file has the CRC32C and length
+ * recorded with the mark, entries compressed before those were recorded
+ * go by the magic number.
+ */
+static int
+iscompressedfile(struct trashent *trashent, int fd, struct stat *statbuf)
+{
+	if (!S_ISREG(statbuf->st_mode) || !isgzip(fd))
+		return 0;
+	if (trashent->compressedlength < 0)
+		return 1;
+	if (statbuf->st_size != trashent->compressedlength)
+		return 0;
+
+	uint32_t crc;
+	off_t len;
+	int status = crc32cfile(fd, &crc, &len);
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		die("lseek:");
+
+	return status == 0 && crc == trashent->compressedcrc &&
+		len == trashent->compressedlength;
+}
+
+/*
+ * Restore a compressed trashent by decompressing its file into
+ * $Trash/staging, a chunk at a time, and moving the result into place.  A
+ * file is verified as it's decompressed, a tree once it's extracted.
+ * Return -1 if the file isn't compressed after all, as when compression
+ * was interrupted between marking the info file and swapping the file.
+ */
+static int
+restorecompressed(struct trashent *trashent)
+{
+	Trash *trash = trashent->trash;
+
+	int fd = openat(trash->filesfd, trashent->filesfilename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) < 0 || !iscompressedfile(trashent, fd, &statbuf)) {
+		close(fd);
+		return -1;
+	}
+
+	char stagename[STAGENAMELEN];
+	stage(trash, stagename);
+
+	struct extracteddirs dirs = { NULL, 0 };
+	int status;
+	uint32_t crc;
+	off_t len = 0;
+	if (trashent->compressed == GZIP) {
+		int outfd = openat(trash->stagingfd, stagename,
+				O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (outfd < 0)
+			die("open: cannot create '%s/staging/%s':", trash->trashdirpath, stagename);
+		status = gunzipfd(fd, outfd, trash->verify ? &crc : NULL);
+		len = lseek(outfd, 0, SEEK_CUR);
+		if (fchmod(outfd, statbuf.st_mode & 07777) < 0)
+			die("chmod:");
+		if (close(outfd) < 0)
+			die("close:");
+	} else {
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC) < 0)
+			die("pipe:");
+
+		struct pipejob job = { fd, fds[1], -1, NULL, 0 };
+		pthread_t thread;
+		if ((errno = pthread_create(&thread, NULL, gunzipthread, &job)) != 0)
+			die("pthread_create:");
+		extracttree(trash->stagingfd, fds[0], trashent->filesfilename, stagename, &dirs);
+		pthread_join(thread, NULL);
+		close(fds[0]);
+		status = job.status;
+	}
+	close(fd);
+
+	if (status < 0) {
+		purgeat(trash, trash->stagingfd, stagename);
+		die("cannot restore '%s': corrupt data", trashent->filesfilepath);
+	}
+
+	if (trash->verify && (trashent->compressed == GZIP && trashent->checksum == CRC32C ?
+				matchcrc(trashent, crc, len) : verifyent(trashent, trash->stagingfd, stagename)) < 0) {
+		purgeat(trash, trash->stagingfd, stagename);
+		die("cannot restore '%s': verification failed", trashent->deletedfilepath);
+	}
+
+	/* a directory without write permission can't be moved to another one */
+	int rootfd = -1;
+	if (dirs.len > 0 && (rootfd = openat(trash->stagingfd, stagename,
+					O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		die("open: cannot open '%s/staging/%s':", trash->trashdirpath, stagename);
+
+	if (renamenoreplace(trash->stagingfd, stagename, AT_FDCWD, trashent->deletedfilepath) < 0) {
+		int err = errno;
+		purgeat(trash, trash->stagingfd, stagename);
+		errno = err;
+		if (errno == EEXIST)
+			die("Refusing to overwite existing file '%s'", trashent->deletedfilepath);
+		die("cannot restore '%s':", trashent->filesfilepath);
+	}
+	setdirs(rootfd, &dirs);
+	if (rootfd >= 0)
+		close(rootfd);
+
+	if (unlinkat(trash->filesfd, trashent->filesfilename, 0) < 0)
+		die("remove: cannot remove file '%s':", trashent->filesfilepath);
+
+	return 0;
+}
+
+/*
+ * The file is moved to $Trash/expunged before its info file is removed
+ * and only then purged, so an interrupted purge never leaves a half
+ * removed entry that can be restored.  The next purge finishes it.
+ */
+void
+deletetrashent(struct trashent *trashent)
+{
+	Trash *trash = trashent->trash;
+	int expungedfd = opentrashsubdir(trash, "expunged", &trash->expungedfd, 1);
+	int moved = 1;
+
+	lockentries(trash, LOCK_SH);
+	while (renamenoreplace(trash->filesfd, trashent->filesfilename,
+				expungedfd, trashent->filesfilename) < 0) {
+		if (errno == ENOENT) {
+			moved = 0;
+			break;
+		}
+		if (errno != EEXIST)
+			die("rename: cannot remove '%s':", trashent->filesfilepath);
+		purgeat(trash, expungedfd, trashent->filesfilename);
+	}
+
+	if (unlinkat(trash->infofd, trashent->infofilename, 0) < 0)
+		die("remove: cannot remove file '%s':", trashent->infofilepath);
+	updatesummary(trashent, expungedfd, trashent->filesfilename, -1);
+	lockentries(trash, LOCK_UN);
+	dropmanifest(trashent);
+
+	if (moved)
+		purgeat(trash, expungedfd, trashent->filesfilename);
+}
+
+/*
+ * Move the file back to where it was deleted from and drop its info file.
+ * The move never replaces an existing file, so there is no window between
+ * checking the destination and renaming into it.  Files sharing their data
+ * with other entries are copied instead so those are left untouched, and
+ * compressed ones are decompressed.  When verifying, nothing is moved
+ * unless the checksums match.
+ */
+void
+restoretrashent(struct trashent *trashent)
+{
+	Trash *trash = trashent->trash;
+
+	getdeletedfilepath(trashent);
+	lockentries(trash, LOCK_SH);
+	/* a compressed file is its size in the summary, not what it restores to */
+	sizetrashent(trashent, trash->filesfd, trashent->filesfilename);
+
+	int restored = (trashent->compressed == GZIP || trashent->compressed == TARGZIP) &&
+		restorecompressed(trashent) == 0;
+
+	if (!restored && trash->verify &&
+			verifyent(trashent, trash->filesfd, trashent->filesfilename) < 0)
+		die("cannot restore '%s': verification failed", trashent->deletedfilepath);
+
+	struct stat statbuf;
+	if (!restored && fstatat(trash->filesfd, trashent->filesfilename, &statbuf,
+				AT_SYMLINK_NOFOLLOW) == 0 &&
+			isdeduped(trash, trashent->filesfilename, &statbuf)) {
+		copyout(trashent, &statbuf);
+	} else if (!restored && renamenoreplace(trash->filesfd, trashent->filesfilename,
+				AT_FDCWD, trashent->deletedfilepath) < 0) {
+		if (errno == EEXIST)
+			die("Refusing to overwite existing file '%s'", trashent->deletedfilepath);
+		die("cannot restore '%s':", trashent->filesfilepath);
+	}
+
+	/* a deduplicated file has the modification time of the file it was linked to */
+	if (trashent->mtime.tv_nsec != UTIME_OMIT) {
+		struct timespec times[2] = { { 0, UTIME_OMIT }, trashent->mtime };
+		if (utimensat(AT_FDCWD, trashent->deletedfilepath, times, AT_SYMLINK_NOFOLLOW) < 0)
+			warn("cannot set modification time of '%s':", trashent->deletedfilepath);
+	}
+
+	if (unlinkat(trash->infofd, trashent->infofilename, 0) < 0)
+		die("remove: cannot remove file '%s':", trashent->infofilepath);
+	updatesummary(trashent, AT_FDCWD, trashent->deletedfilepath, -1);
+	lockentries(trash, LOCK_UN);
+	dropmanifest(trashent);
+}
+
+/* the keys of an info file */
+struct infofile {
+	char *encoded_deletedfilepath;
+	char *deletiondate;
+	long long size;
+	struct timespec mtime;
+	int compressed;
+	uint32_t compressedcrc;
+	long long compressedlength;
+	int checksum;
+	uint32_t crc;
+	long long length;
+};
+
+static void
+freeinfofile(struct infofile *info)
+{
+	free(info->encoded_deletedfilepath);
+	free(info->deletiondate);
+}
+
+/*
+ * Read the keys of the info file in the len bytes of buf into info, buf
+ * is changed.  String values are without their prefixes and trailing
+ * newlines and missing optional keys are -1.  Return -1 if Path or
+ * DeletionDate is missing or the path isn't absolute.
+ */
+static int
+parseinfo(char *buf, size_t len, struct infofile *info)
+{
+	info->encoded_deletedfilepath = NULL;
+	info->deletiondate = NULL;
+	info->size = -1;
+	info->mtime.tv_sec = 0;
+	info->mtime.tv_nsec = UTIME_OMIT;
+	info->compressed = PLAIN;
+	info->compressedcrc = 0;
+	info->compressedlength = -1;
+	info->checksum = NOCHECKSUM;
+	info->crc = 0;
+	info->length = -1;
+
+	for (char *line = buf, *next; line < buf + len; line = next) {
+		char *end = memchr(line, '\n', buf + len - line);
+		next = end ? end + 1 : buf + len;
+		if (end)
+			*end = '\0';
+
+		char **value;
+		size_t prefixlen;
+		if (strncmp(line, "Path=", strlen("Path=")) == 0) {
+			value = &info->encoded_deletedfilepath;
+			prefixlen = strlen("Path=");
+		} else if (strncmp(line, "DeletionDate=",
+					strlen("DeletionDate=")) == 0) {
+			value = &info->deletiondate;
+			prefixlen = strlen("DeletionDate=");
+		} else {
+			long long sec;
+			long nsec;
+			unsigned int crc;
+			if (strncmp(line, "X-Size=", strlen("X-Size=")) == 0)
+				info->size = strtoll(line + strlen("X-Size="), NULL, 10);
+			else if (sscanf(line, "X-Mtime=%lld.%ld", &sec, &nsec) == 2 &&
+					nsec >= 0 && nsec < 1000000000) {
+				info->mtime.tv_sec = sec;
+				info->mtime.tv_nsec = nsec;
+			} else if (strcmp(line, "X-Compressed=gzip") == 0)
+				info->compressed = GZIP;
+			else if (strcmp(line, "X-Compressed=tar+gzip") == 0)
+				info->compressed = TARGZIP;
+			else if (strcmp(line, "X-Compressed=none") == 0)
+				info->compressed = INCOMPRESSIBLE;
+			else if (sscanf(line, "X-Compressed-Checksum=crc32c:%x %lld",
+						&crc, &info->compressedlength) == 2)
+				info->compressedcrc = crc;
+			else if (sscanf(line, "X-Checksum=crc32c:%x", &crc) == 1) {
+				info->checksum = CRC32C;
+				info->crc = crc;
+			} else if (strcmp(line, "X-Checksum=manifest") == 0)
+				info->checksum = MANIFEST;
+			else if (strncmp(line, "X-Length=", strlen("X-Length=")) == 0)
+				info->length = strtoll(line + strlen("X-Length="), NULL, 10);
+			continue;
+		}
+
+		free(*value);
+		*value = xmalloc((strlen(line) - prefixlen + 1) * sizeof(**value));
+		strcpy(*value, line + prefixlen);
+	}
+	if (!info->encoded_deletedfilepath || !info->deletiondate ||
+			info->encoded_deletedfilepath[0] != '/') {
+		freeinfofile(info);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Parse the info file open on fd with parseinfo(), fd is closed. */
+static int
+parseinfofile(int fd, struct infofile *info)
+{
+	/*
+	 * Read it whole, info files rarely outgrow the stack buffer.  It's a
+	 * regular file, so a short read is the end of it.
+	 */
+	char stackbuf[4096];
+	char *buf = stackbuf;
+	size_t cap = sizeof(stackbuf), len = 0;
+	ssize_t n;
+	while ((n = read(fd, buf + len, cap - len - 1)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			die("read:");
+		}
+		len += n;
+		if (len < cap - 1)
+			break;
+
+		char *newbuf = xmalloc(2 * cap);
+		memcpy(newbuf, buf, len);
+		if (buf != stackbuf)
+			free(buf);
+		buf = newbuf;
+		cap *= 2;
+	}
+	buf[len] = '\0';
+	if (close(fd) < 0)
+		die("close:");
+
+	int status = parseinfo(buf, len, info);
+	if (buf != stackbuf)
+		free(buf);
+
+	return status;
+}
+
+/*
+ * Return the entry described by $Trash/info/infofilename, or NULL if the
+ * info file can't be opened or isn't valid.
+ */
+struct trashent *
+readinfofile(Trash *trash, const char *infofilename)
+{
+	if (!strendswith(infofilename, ".trashinfo"))
+		return NULL;
+
+	struct stat statbuf;
+
+	int fd = openat(trash->infofd, infofilename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &statbuf) < 0)
+		die("stat:");
+
+	if (!S_ISREG(statbuf.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+
+	struct infofile info;
+	if (parseinfofile(fd, &info) < 0)
+		return NULL;
+
+	time_t deletiontime = strtotime(info.deletiondate);
+	if (deletiontime == -1) {
+		freeinfofile(&info);
+		return NULL;
+	}
+
+	int trashfilenamelen = strlen(infofilename) - strlen(".trashinfo");
+	char trashfilename[trashfilenamelen + 1];
+	strncpy(trashfilename, infofilename, trashfilenamelen);
+	trashfilename[trashfilenamelen] = '\0';
+
+	struct trashent *trashent = createtrashent(trash, trashfilename, deletiontime);
+	trashent->encoded_deletedfilepath = info.encoded_deletedfilepath;
+	info.encoded_deletedfilepath = NULL;
+	trashent->size = info.size;
+	trashent->mtime = info.mtime;
+	trashent->compressed = info.compressed;
+	trashent->compressedcrc = info.compressedcrc;
+	trashent->compressedlength = info.compressedlength;
+	trashent->checksum = info.checksum;
+	trashent->crc = info.crc;
+	trashent->length = info.length;
+
+	freeinfofile(&info);
+
+	return trashent;
+}
+
+/*
+ * Link an info file holding the already written tmpfd into
+ * $Trash/info/infofilename.  Fail with EEXIST if that name is taken.
+ */
+static int
+linkinfofile(Trash *trash, int tmpfd, const char *infofilename)
+{
+	char procpath[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+	sprintf(procpath, "/proc/self/fd/%d", tmpfd);
+
+	return linkat(AT_FDCWD, procpath, trash->infofd, infofilename, AT_SYMLINK_FOLLOW);
+}
+
+/*
+ * Create $Trash/info/infofilename holding buf, the file is complete once
+ * it's visible.  Fail with EEXIST if that name is taken.  *tmpfd is an
+ * unnamed file in $Trash/info holding buf, or -1 if the file system
+ * doesn't support O_TMPFILE and the file has to be written in place.  It
+ * can be linked again after an EEXIST, but not once it was linked and
+ * that link removed, it needs a new one from opentmpinfofile() then.
+ */
+static int
+createinfofile(Trash *trash, int *tmpfd, const char *infofilename, const char *buf, size_t len)
+{
+	if (*tmpfd >= 0) {
+		if (linkinfofile(trash, *tmpfd, infofilename) == 0)
+			return 0;
+		if (errno == EEXIST)
+			return -1;
+		if (errno != ENOENT)
+			die("linkat: cannot create '%s/%s':", trash->infodirpath, infofilename);
+		/* /proc isn't mounted, fall back to writing in place */
+		close(*tmpfd);
+		*tmpfd = -1;
+	}
+
+	int fd = openat(trash->infofd, infofilename,
+			O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		if (errno == EEXIST)
+			return -1;
+		die("open: cannot create '%s/%s':", trash->infodirpath, infofilename);
+	}
+
+	if (xwrite(fd, buf, len) < 0)
+		die("write:");
+	if (close(fd) < 0)
+		die("close:");
+
+	return 0;
+}
+
+/*
+ * Return an unnamed file in $Trash/info holding buf, for createinfofile(),
+ * or -1 if the file system doesn't support them.
+ */
+static int
+opentmpinfofile(Trash *trash, const char *buf, size_t len)
+{
+	int tmpfd = openat(trash->infofd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC,
+			S_IRUSR | S_IWUSR);
+	if (tmpfd < 0) {
+		if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+			die("open: cannot create file in '%s':", trash->infodirpath);
+	} else if (xwrite(tmpfd, buf, len) < 0) {
+		die("write:");
+	}
+
+	return tmpfd;
+}
+
+/*
+ * Create the info file holding buf and then move path in dirfd into
+ * $Trash/files, under trashent's name or under that name with a "_N"
+ * suffix if it is taken.  Return -1 if path can't be moved, its info file
+ * is removed again then.
+ */
+static int
+linkentry(struct trashent *trashent, int *tmpfd, const char *buf, size_t buflen,
+		int dirfd, const char *path)
+{
+	Trash *trash = trashent->trash;
+
+	unsigned long namelen = strlen(trashent->filesfilename);
+	char name[namelen + 1];
+	strcpy(name, trashent->filesfilename);
+
+	for (int i = 1; ; i++) {
+		if (createinfofile(trash, tmpfd, trashent->infofilename, buf, buflen) == 0) {
+			if (renamenoreplace(dirfd, path, trash->filesfd, trashent->filesfilename) == 0)
+				return 0;
+			/*
+			 * Drop the info file again, on EEXIST a stray file in
+			 * $Trash/files has the name and is left alone.
+			 */
+			int err = errno;
+			if (unlinkat(trash->infofd, trashent->infofilename, 0) < 0)
+				die("remove: cannot remove file '%s':", trashent->infofilepath);
+			errno = err;
+			if (errno != EEXIST)
+				return -1;
+			/* an unnamed file can't be linked again once unlinked */
+			if (*tmpfd >= 0) {
+				close(*tmpfd);
+				*tmpfd = opentmpinfofile(trash, buf, buflen);
+			}
+		}
+
+		char suffixed[namelen + 1 + 3 * sizeof(int) + 1];
+		sprintf(suffixed, "%s_%d", name, i);
+		setnametrashent(trashent, suffixed);
+	}
+}
+
+/*
+ * Trash trashent->deletedfilepath under the name set by createtrashent(),
+ * or under that name with a "_N" suffix if it is taken.
+ *
+ * The info file is written in one go to an unnamed file and linked into
+ * $Trash/info, and only then is the file moved into $Trash/files.  A crash
+ * at any point leaves either nothing or a complete info file behind, never
+ * a file in $Trash/files without one.
+ *
+ * The first put locks the entries until closetrash() closes $Trash/info,
+ * so a run trashing many files locks them and looks for a summary once,
+ * and a summary build waits for it to finish.
+ */
+void
+committrashent(struct trashent *trashent)
+{
+	Trash *trash = trashent->trash;
+
+	char *encoded_deletedfilepath = fullpath_encode(trashent->deletedfilepath);
+	char deletiondate[DATELEN];
+	timetostr(trashent->deletiontime, deletiondate);
+
+	if (!trash->putlocked) {
+		lockentries(trash, LOCK_SH);
+		trash->putlocked = 1;
+	}
+	if (hassummary(trash))
+		trashent->size = diskusage(AT_FDCWD, trashent->deletedfilepath);
+
+	size_t buflen = strlen("[Trash Info]\nPath=\nDeletionDate=\n")
+		+ strlen(encoded_deletedfilepath) + strlen(deletiondate);
+	if (trashent->size >= 0)
+		buflen += strlen("X-Size=\n") + 3 * sizeof(trashent->size);
+	char *buf = xmalloc((buflen + 1) * sizeof(*buf));
+	buflen = sprintf(buf, "[Trash Info]\n"
+			"Path=%s\n"
+			"DeletionDate=%s\n",
+			encoded_deletedfilepath, deletiondate);
+	if (trashent->size >= 0)
+		buflen += sprintf(buf + buflen, "X-Size=%lld\n", trashent->size);
+
+	int tmpfd = opentmpinfofile(trash, buf, buflen);
+	if (linkentry(trashent, &tmpfd, buf, buflen, AT_FDCWD, trashent->deletedfilepath) < 0)
+		die("cannot trash '%s':", trashent->deletedfilepath);
+	updatesummary(trashent, trash->filesfd, trashent->filesfilename, 1);
+	if (tmpfd >= 0 && close(tmpfd) < 0)
+		die("close:");
+	free(buf);
+	free(encoded_deletedfilepath);
+}
+
+void
+asserttrash(Trash *trash)
+{
+	assert(trash != NULL);
+
+	assert(trash->trashfd >= 0);
+	assert(trash->filesfd >= 0);
+	assert(trash->infofd >= 0);
+
+	assert(trash->trashdirpath != NULL);
+	assert(trash->filesdirpath != NULL);
+	assert(trash->infodirpath != NULL);
+}
+
+Trash *
+createtrash(const char *trashpath)
+{
+	assert(trashpath != NULL);
+
+	Trash *trash = xmalloc(sizeof(*trash));
+
+	int trashpathlen = strlen(trashpath);
+	trash->trashdirpath = xmalloc(trashpathlen + 1);
+	trash->filesdirpath = xmalloc(
+			(trashpathlen + strlen("/files") + 1) * sizeof(char));
+	trash->infodirpath = xmalloc(
+			(trashpathlen + strlen("/info") + 1) * sizeof(char));
+
+	strcpy(trash->trashdirpath, trashpath);
+	sprintf(trash->filesdirpath, "%s%s", trashpath, "/files");
+	sprintf(trash->infodirpath, "%s%s", trashpath, "/info");
+
+	/* the trash almost always exists, only walk its path when it doesn't */
+	trash->trashfd = open(trash->trashdirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (trash->trashfd < 0 && errno == ENOENT) {
+		xmkdir(trash->trashdirpath);
+		trash->trashfd = open(trash->trashdirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	if (trash->trashfd < 0)
+		die("open: cannot open directory '%s':", trashpath);
+
+	trash->infodir = NULL;
+	trash->filesfd = -1;
+	trash->infofd = -1;
+	opentrashsubdir(trash, "files", &trash->filesfd, 1);
+	opentrashsubdir(trash, "info", &trash->infofd, 1);
+	trash->expungedfd = -1;
+	trash->dedupfd = -1;
+	trash->checksumsfd = -1;
+	trash->stagingfd = -1;
+	trash->dedup = 0;
+	trash->checksum = 0;
+	trash->verify = 0;
+	trash->hassummary = -1;
+	trash->putlocked = 0;
+
+	bucketinit(&trash->bytebucket, 0);
+	bucketinit(&trash->opbucket, 0);
+
+	return trash;
+}
+
+/*
+ * trashpath is /path/to/trash/directory.
+ * If trashpath is NULL use the home trash directory (e.g. XDG_DATA_HOME/Trash).
+ */
+Trash *
+opentrash(const char *trashpath)
+{
+	Trash *trash;
+	if (!trashpath) {
+		char hometrash[PATH_MAX + 1];
+		const char *home = xgetenv("HOME", NULL);
+		if (!home)
+			die("HOME is not set");
+
+		char defaultxdgdata[strlen(home) + strlen("/.local/share") + 1];
+		sprintf(defaultxdgdata, "%s%s", home, "/.local/share");
+
+		sprintf(hometrash, "%s/Trash", xgetenv("XDG_DATA_HOME", defaultxdgdata));
+		trash = createtrash(hometrash);
+		return trash;
+	}
+
+	trash = createtrash(trashpath);
+	return trash;
+}
+
+void
+closetrash(Trash *trash)
+{
+	asserttrash(trash);
+
+	if (trash->infodir && closedir(trash->infodir) < 0)
+		die("closedir:");
+
+	if (close(trash->trashfd) < 0 || close(trash->filesfd) < 0 || close(trash->infofd) < 0)
+		die("close:");
+	if (trash->expungedfd >= 0 && close(trash->expungedfd) < 0)
+		die("close:");
+	if (trash->dedupfd >= 0 && close(trash->dedupfd) < 0)
+		die("close:");
+	if (trash->checksumsfd >= 0 && close(trash->checksumsfd) < 0)
+		die("close:");
+	if (trash->stagingfd >= 0 && close(trash->stagingfd) < 0)
+		die("close:");
+
+	free(trash->trashdirpath);
+	free(trash->infodirpath);
+	free(trash->filesdirpath);
+	free(trash);
+}
+
+/*
+ * Limit how fast entries are purged to rate bytes and iops files or
+ * truncations per second, 0 means unlimited.
+ */
+void
+trashthrottle(Trash *trash, unsigned long long rate, unsigned long iops)
+{
+	asserttrash(trash);
+
+	bucketinit(&trash->bytebucket, rate);
+	bucketinit(&trash->opbucket, iops);
+}
+
+/* Have trashput() replace regular files with hardlinks to identical ones. */
+void
+trashsetdedup(Trash *trash, int dedup)
+{
+	asserttrash(trash);
+
+	trash->dedup = dedup;
+}
+
+/* Have trashput() record checksums of the files it puts. */
+void
+trashsetchecksum(Trash *trash, int checksum)
+{
+	asserttrash(trash);
+
+	trash->checksum = checksum;
+}
+
+/* Have trashrestore() check files against their checksums before moving them. */
+void
+trashsetverify(Trash *trash, int verify)
+{
+	asserttrash(trash);
+
+	trash->verify = verify;
+}
+
+void
+rewindtrash(Trash *trash)
+{
+	asserttrash(trash);
+
+	if (trash->infodir) {
+		rewinddir(trash->infodir);
+		return;
+	}
+
+	int fd = openat(trash->infofd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || !(trash->infodir = fdopendir(fd)))
+		die("opendir: cannot open directory '%s':", trash->infodirpath);
+}
+
+/* Return the next valid entry in trash, invalid ones are skipped with a warning. */
+struct trashent *
+readTrash(Trash *trash)
+{
+	asserttrash(trash);
+	struct trashent *trashent = NULL;
+	struct dirent *dp = NULL;
+
+	if (!trash->infodir)
+		rewindtrash(trash);
+
+	errno = 0;
+	while ((dp = readdir(trash->infodir)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+			continue;
+
+		if (!strendswith(dp->d_name, ".trashinfo"))
+			continue;
+
+		errno = 0;
+		trashent = readinfofile(trash, dp->d_name);
+		if (trashent)
+			break;
+
+		if (errno != 0)
+			warn("skipping '%s/%s':", trash->infodirpath, dp->d_name);
+		else
+			warn("skipping invalid info file '%s/%s'", trash->infodirpath, dp->d_name);
+		errno = 0;
+	}
+
+	if (dp == NULL && errno != 0)
+		die("readir:");
+
+	return dp != NULL ? trashent : NULL;
+}
+
+/* fullpath is the canonical path returned by realpath */
+int
+istrashablepath(Trash *trash, const char *fullpath)
+{
+	return (
+		strncmp(trash->trashdirpath, fullpath, strlen(fullpath)) &&
+		strcmp(trash->filesdirpath, fullpath) &&
+		strcmp(trash->infodirpath, fullpath)
+	);
+}
+
+int
+trashput(Trash *trash, const char *path)
+{
+	asserttrash(trash);
+	assert(path != NULL);
+
+	char fullpath[PATH_MAX];
+	if (!realpath(path, fullpath))
+		die("'%s' doesn't exit:", path);
+
+	// Prevent trashing a component of the trash directory path
+	if (!istrashablepath(trash, fullpath))
+		die("cannot trash '%s'", path);
+
+	char buf[PATH_MAX];
+	// Get the basename of fullpath
+	char *fullpath_copy = buf;
+	strcpy(fullpath_copy, fullpath);
 	char *trashfilesfilename = basename(fullpath_copy);
 
 	struct trashent *trashent = createtrashent(trash, trashfilesfilename, time(NULL));
 	trashent->deletedfilepath = xmalloc((strlen(fullpath) + 1) * sizeof(char));
 	strcpy(trashent->deletedfilepath, fullpath);
 
+	committrashent(trashent);
+	if (trash->checksum)
+		checksumput(trashent);
+	if (trash->dedup)
+		dedupput(trashent);
+	freetrashent(trashent);
+
+	return 0;
+}
+
+void
+trashlist(Trash *trash)
+{
+	asserttrash(trash);
+
+	rewindtrash(trash);
+
+	struct trashent *trashent;
+
+	char deletiondate[DATELEN];
+	while ((trashent = readTrash(trash)) != NULL) {
+		printf("%s %s\n", timetostr(trashent->deletiontime, deletiondate),
+				getdeletedfilepath(trashent));
+
+		freetrashent(trashent);
+	}
+}
+
+struct check {
+	Trash *trash;
+	char **names;
+	char *valid;
+	size_t len;
+	size_t next;
+};
+
+/* Return whether $Trash/info/trashfilename.trashinfo is valid. */
+static int
+checkinfofile(Trash *trash, const char *trashfilename)
+{
+	char infofilename[strlen(trashfilename) + strlen(".trashinfo") + 1];
+	sprintf(infofilename, "%s.trashinfo", trashfilename);
+
+	int fd = openat(trash->infofd, infofilename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode)) {
+		close(fd);
+		return 0;
+	}
+
+	struct infofile info;
+	if (parseinfofile(fd, &info) < 0)
+		return 0;
+
+	int valid = isdate(info.deletiondate);
+	freeinfofile(&info);
+
+	return valid;
+}
+
+static void *
+checkinfofiles(void *arg)
+{
+	struct check *check = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&check->next, 1, __ATOMIC_RELAXED)) < check->len)
+		check->valid[i] = checkinfofile(check->trash, check->names[i]);
+
+	return NULL;
+}
+
+static int
+cmpnames(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-	committrashent(trashent);
-	freetrashent(trashent);
+/* Move $Trash/{files,info}/name into $Trash/quarantine, return -1 on failure. */
+static int
+quarantine(Trash *trash, int *quarantinefd, int dirfd, const char *name)
+{
+	opentrashsubdir(trash, "quarantine", quarantinefd, 1);
+
+	if (renamenoreplace(dirfd, name, *quarantinefd, name) < 0 && errno != ENOENT) {
+		warn("cannot quarantine '%s':", name);
+		return -1;
+	}
 
 	return 0;
 }
 
+/*
+ * Check that every file in $Trash/files has a valid info file and every
+ * info file has a file.  Both directories are read in one go, sorted and
+ * merged, and the info files of the matching pairs are validated in
+ * parallel.  Problems are printed on stdout.  With repair, info files
+ * without a file are removed and files without a valid info file are moved
+ * to $Trash/quarantine along with their info file, with the trash locked
+ * against changes that are underway.
+ *
+ * Return the number of problems found.
+ */
+size_t
+trashcheck(Trash *trash, int repair)
+{
+	asserttrash(trash);
+
+	if (repair)
+		lockentries(trash, LOCK_EX);
+
+	struct dirlist files, infos;
+	listdir(trash->filesfd, &files);
+	listdir(trash->infofd, &infos);
+
+	size_t ninfos = 0, nunknown = 0;
+	for (size_t i = 0; i < infos.len; i++) {
+		if (!strendswith(infos.names[i], ".trashinfo")) {
+			printf("unknown file: %s/%s\n", trash->infodirpath, infos.names[i]);
+			nunknown++;
+			continue;
+		}
+		infos.names[i][strlen(infos.names[i]) - strlen(".trashinfo")] = '\0';
+		infos.names[ninfos++] = infos.names[i];
+	}
+
+	qsort(files.names, files.len, sizeof(*files.names), cmpnames);
+	qsort(infos.names, ninfos, sizeof(*infos.names), cmpnames);
+
+	char **orphanedfiles = xmalloc((files.len + 1) * sizeof(*orphanedfiles));
+	char **orphanedinfos = xmalloc((ninfos + 1) * sizeof(*orphanedinfos));
+	char **pairs = xmalloc((files.len + 1) * sizeof(*pairs));
+	size_t norphanedfiles = 0, norphanedinfos = 0, npairs = 0;
+
+	for (size_t i = 0, j = 0; i < files.len || j < ninfos; ) {
+		int cmp = i == files.len ? 1 : j == ninfos ? -1
+			: strcmp(files.names[i], infos.names[j]);
+		if (cmp < 0) {
+			orphanedfiles[norphanedfiles++] = files.names[i++];
+		} else if (cmp > 0) {
+			orphanedinfos[norphanedinfos++] = infos.names[j++];
+		} else {
+			pairs[npairs++] = files.names[i++];
+			j++;
+		}
+	}
+
+	struct check check = { trash, pairs, xmalloc(npairs + 1), npairs, 0 };
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	if ((size_t)nthreads > npairs / 64 + 1)
+		nthreads = npairs / 64 + 1;
+
+	pthread_t threads[nthreads];
+	for (long i = 1; i < nthreads; i++)
+		if ((errno = pthread_create(&threads[i], NULL, checkinfofiles, &check)) != 0)
+			die("pthread_create:");
+	checkinfofiles(&check);
+	for (long i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	int quarantinefd = -1;
+	size_t nproblems = nunknown + norphanedfiles + norphanedinfos;
+
+	for (size_t i = 0; i < norphanedinfos; i++) {
+		char infofilename[strlen(orphanedinfos[i]) + strlen(".trashinfo") + 1];
+		sprintf(infofilename, "%s.trashinfo", orphanedinfos[i]);
+
+		printf("orphaned info: %s/%s", trash->infodirpath, infofilename);
+		if (repair) {
+			if (unlinkat(trash->infofd, infofilename, 0) < 0)
+				die("remove: cannot remove file '%s/%s':", trash->infodirpath, infofilename);
+			printf(" (removed)");
+		}
+		putchar('\n');
+	}
+
+	for (size_t i = 0; i < norphanedfiles; i++) {
+		printf("orphaned file: %s/%s", trash->filesdirpath, orphanedfiles[i]);
+		if (repair && quarantine(trash, &quarantinefd, trash->filesfd, orphanedfiles[i]) == 0)
+			printf(" (quarantined)");
+		putchar('\n');
+	}
+
+	for (size_t i = 0; i < npairs; i++) {
+		if (check.valid[i])
+			continue;
+
+		char infofilename[strlen(pairs[i]) + strlen(".trashinfo") + 1];
+		sprintf(infofilename, "%s.trashinfo", pairs[i]);
+
+		nproblems++;
+		printf("invalid info: %s/%s", trash->infodirpath, infofilename);
+		if (repair && quarantine(trash, &quarantinefd, trash->filesfd, pairs[i]) == 0 &&
+				quarantine(trash, &quarantinefd, trash->infofd, infofilename) == 0)
+			printf(" (quarantined)");
+		putchar('\n');
+	}
+
+	if (quarantinefd >= 0 && close(quarantinefd) < 0)
+		die("close:");
+
+	/* repairs bypass the summary, have it rebuilt */
+	if (repair && nproblems > nunknown && unlinkat(trash->trashfd, "summary", 0) < 0 &&
+			errno != ENOENT)
+		die("remove: cannot remove summary:");
+	if (repair)
+		lockentries(trash, LOCK_UN);
+
+	free(check.valid);
+	free(pairs);
+	free(orphanedinfos);
+	free(orphanedfiles);
+	freedirlist(&infos);
+	freedirlist(&files);
+
+	return nproblems;
+}
+
+/*
+ * Return the summary of trash.  It's kept up to date by every change to
+ * the trash, and only built by reading the whole trash the first time.
+ */
+static struct summary *
+loadsummary(Trash *trash)
+{
+	/* no entry changes while the summary may be built from the entries */
+	lockentries(trash, LOCK_EX);
+	int trashfd = trash->trashfd;
+	if (flock(trashfd, LOCK_EX) < 0)
+		die("flock:");
+
+	struct summary *summary = readsummary(trashfd);
+	if (!summary) {
+		summary = createsummary();
+
+		rewindtrash(trash);
+		struct trashent *trashent;
+		while ((trashent = readTrash(trash)) != NULL) {
+			if (trashent->size < 0)
+				trashent->size = diskusage(trash->filesfd, trashent->filesfilename);
+			summaryadd(summary, trashent->deletiontime, trashent->size,
+					getdeletedfilepath(trashent), 1);
+			freetrashent(trashent);
+		}
+
+		writesummary(summary, trashfd);
+		trash->hassummary = 1;
+	}
+
+	if (flock(trashfd, LOCK_UN) < 0)
+		die("flock:");
+	lockentries(trash, LOCK_UN);
+
+	return summary;
+}
+
+/* Print the summaries of the ntrashes trashes in the Prometheus text format. */
 void
-trashlist(Trash *trash)
+trashmetrics(Trash **trashes, size_t ntrashes)
+{
+	struct summary *summaries[ntrashes];
+	const char *trashdirpaths[ntrashes];
+
+	for (size_t i = 0; i < ntrashes; i++) {
+		asserttrash(trashes[i]);
+		summaries[i] = loadsummary(trashes[i]);
+		trashdirpaths[i] = trashes[i]->trashdirpath;
+	}
+
+	printsummaries(summaries, trashdirpaths, ntrashes);
+
+	for (size_t i = 0; i < ntrashes; i++)
+		freesummary(summaries[i]);
+}
+
+void
+trashclean(Trash *trash)
 {
 	asserttrash(trash);
 
+	purgeexpunged(trash);
 	rewindtrash(trash);
 
 	struct trashent *trashent;
-
 	while ((trashent = readTrash(trash)) != NULL) {
-		char *deletiondate = timetostr(trashent->deletiontime);
-		printf("%s %s\n", deletiondate, trashent->deletedfilepath);
-
+		deletetrashent(trashent);
 		freetrashent(trashent);
-		free(deletiondate);
 	}
 }
 
+static int
+cmpsizes(const void *a, const void *b)
+{
+	const struct dedupent *x = a, *y = b;
+
+	return (x->statbuf.st_size > y->statbuf.st_size) - (x->statbuf.st_size < y->statbuf.st_size);
+}
+
+/*
+ * Replace the regular files in $Trash/files that are identical to another
+ * with hardlinks to it and rebuild $Trash/dedup.  Files are grouped by
+ * size and only those in a group of several are hashed.
+ */
 void
-trashclean(Trash *trash)
+trashdedup(Trash *trash)
+{
+	asserttrash(trash);
+
+	struct dirlist files;
+	listdir(trash->filesfd, &files);
+
+	struct dedupent *ents = xmalloc((files.len + 1) * sizeof(*ents));
+	size_t nents = 0;
+	for (size_t i = 0; i < files.len; i++) {
+		struct dedupent *ent = &ents[nents];
+		if (fstatat(trash->filesfd, files.names[i], &ent->statbuf, AT_SYMLINK_NOFOLLOW) < 0 ||
+				!S_ISREG(ent->statbuf.st_mode) || ent->statbuf.st_size == 0)
+			continue;
+		ent->name = files.names[i];
+		ent->hashed = 0;
+		nents++;
+	}
+	qsort(ents, nents, sizeof(*ents), cmpsizes);
+
+	int trashfd = trash->trashfd;
+	if (flock(trashfd, LOCK_EX) < 0)
+		die("flock:");
+
+	size_t ndeduped = 0;
+	long long saved = 0;
+	for (size_t i = 0, j; i < nents; i = j) {
+		for (j = i + 1; j < nents && ents[j].statbuf.st_size == ents[i].statbuf.st_size; j++)
+			;
+		struct dedupbucket group = { ents[i].statbuf.st_size, &ents[i], j - i };
+
+		if (group.len > 1) {
+			/* keep the hashes already in the index */
+			struct dedupbucket old;
+			readbucket(trash, group.size, &old);
+			for (size_t k = 0; k < old.len; k++) {
+				for (size_t l = 0; l < group.len && old.ents[k].hashed; l++) {
+					if (group.ents[l].statbuf.st_ino == old.ents[k].statbuf.st_ino &&
+							strcmp(group.ents[l].name, old.ents[k].name) == 0) {
+						group.ents[l].hashed = 1;
+						group.ents[l].hash = old.ents[k].hash;
+					}
+				}
+			}
+			freebucket(&old);
+
+			for (size_t k = 0; k < group.len; k++) {
+				blkcnt_t blocks = group.ents[k].statbuf.st_blocks;
+				if (dedupbucketent(trash, &group, k)) {
+					ndeduped++;
+					saved += (long long)blocks * 512;
+				}
+			}
+		}
+
+		writebucket(trash, &group);
+	}
+
+	/* drop the buckets of sizes no file has anymore */
+	opentrashsubdir(trash, "dedup", &trash->dedupfd, 1);
+	struct dirlist buckets;
+	listdir(trash->dedupfd, &buckets);
+	for (size_t i = 0; i < buckets.len; i++) {
+		struct dedupent key;
+		char *end;
+		key.statbuf.st_size = strtoll(buckets.names[i], &end, 10);
+		if (*end == '\0' &&
+				bsearch(&key, ents, nents, sizeof(*ents), cmpsizes))
+			continue;
+		if (unlinkat(trash->dedupfd, buckets.names[i], 0) < 0 && errno != ENOENT)
+			die("remove: cannot remove '%s/dedup/%s':", trash->trashdirpath, buckets.names[i]);
+	}
+	freedirlist(&buckets);
+
+	if (flock(trashfd, LOCK_UN) < 0)
+		die("flock:");
+
+	printf("deduplicated %zu files, %lld bytes saved\n", ndeduped, saved);
+
+	free(ents);
+	freedirlist(&files);
+}
+
+/* an entry to compress and how it went */
+struct compressjob {
+	struct trashent *trashent;
+	/* disk usage before and after */
+	long long oldsize;
+	long long newsize;
+	/* bytes read and written by the compressor */
+	off_t in;
+	off_t out;
+	int done;
+};
+
+struct compression {
+	Trash *trash;
+	struct compressjob *jobs;
+	size_t len;
+	size_t next;
+};
+
+static void *
+tarthread(void *arg)
+{
+	struct pipejob *job = arg;
+
+	/* whether some of the tree couldn't be archived as it is */
+	job->status = tarputfile(job->outfd, job->name, job->dirfd, job->name) > 0;
+	tarputend(job->outfd);
+	close(job->outfd);
+
+	return NULL;
+}
+
+/*
+ * Compress the file of job's entry into $Trash/staging, a directory as a
+ * tar archive.  The info file is marked before the two are swapped, with
+ * the CRC32C and length of the compressed file, so an interruption leaves
+ * either the old file or the compressed one in place and restore tells
+ * them apart by those.  The old file is left in $Trash/expunged to be
+ * purged.  A tree holding special files or hardlinks, which the archive
+ * can't keep, is left as it is.
+ */
+static void
+compressent(Trash *trash, struct compressjob *job)
+{
+	struct trashent *trashent = job->trashent;
+	struct stat statbuf;
+
+	if (fstatat(trash->filesfd, trashent->filesfilename, &statbuf, AT_SYMLINK_NOFOLLOW) < 0 ||
+			!(S_ISDIR(statbuf.st_mode) || (S_ISREG(statbuf.st_mode) &&
+					statbuf.st_nlink == 1 && statbuf.st_size > 0)))
+		return;
+
+	char tmpname[STAGENAMELEN];
+	stage(trash, tmpname);
+
+	int outfd = openat(trash->stagingfd, tmpname,
+			O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (outfd < 0) {
+		warn("open: cannot create '%s/staging/%s':", trash->trashdirpath, tmpname);
+		return;
+	}
+
+	job->oldsize = diskusage(trash->filesfd, trashent->filesfilename);
+	int lossy = 0;
+	if (S_ISREG(statbuf.st_mode)) {
+		int infd = openat(trash->filesfd, trashent->filesfilename,
+				O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (infd < 0)
+			die("open: cannot open '%s':", trashent->filesfilepath);
+		posix_fadvise(infd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		gzipfd(infd, outfd, &job->in, &job->out);
+		close(infd);
+	} else {
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC) < 0)
+			die("pipe:");
+
+		struct pipejob tarjob = { -1, fds[1], trash->filesfd, trashent->filesfilename, 0 };
+		pthread_t thread;
+		if ((errno = pthread_create(&thread, NULL, tarthread, &tarjob)) != 0)
+			die("pthread_create:");
+		gzipfd(fds[0], outfd, &job->in, &job->out);
+		pthread_join(thread, NULL);
+		close(fds[0]);
+		lossy = tarjob.status;
+	}
+
+	int compressed = S_ISREG(statbuf.st_mode) ? GZIP : TARGZIP;
+	if (lossy || job->out >= job->in) {
+		close(outfd);
+		unlinkat(trash->stagingfd, tmpname, 0);
+		char *keys[] = { "X-Compressed=none" };
+		setinfokeys(trash, trashent->infofilename, keys, 1);
+		return;
+	}
+
+	struct timespec times[2] = { statbuf.st_atim, statbuf.st_mtim };
+	if ((S_ISREG(statbuf.st_mode) && fchmod(outfd, statbuf.st_mode & 07777) < 0) ||
+			futimens(outfd, times) < 0 || fsync(outfd) < 0)
+		die("cannot write '%s/staging/%s':", trash->trashdirpath, tmpname);
+	if (close(outfd) < 0)
+		die("close:");
+	job->newsize = diskusage(trash->stagingfd, tmpname);
+
+	uint32_t crc;
+	off_t len;
+	int crcfd = openat(trash->stagingfd, tmpname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (crcfd < 0 || crc32cfile(crcfd, &crc, &len) < 0)
+		die("cannot checksum '%s/staging/%s':", trash->trashdirpath, tmpname);
+	close(crcfd);
+
+	char *keys[4];
+	size_t nkeys = 0;
+	char mtime[strlen("X-Mtime=.") + 3 * sizeof(long long) + 9 + 1];
+	char size[strlen("X-Size=") + 3 * sizeof(long long) + 1];
+	char checksum[strlen("X-Compressed-Checksum=crc32c: ") + 8 + 3 * sizeof(long long) + 1];
+	keys[nkeys++] = compressed == GZIP ? "X-Compressed=gzip" : "X-Compressed=tar+gzip";
+	sprintf(checksum, "X-Compressed-Checksum=crc32c:%08x %lld", crc, (long long)len);
+	keys[nkeys++] = checksum;
+	if (trashent->mtime.tv_nsec == UTIME_OMIT) {
+		sprintf(mtime, "X-Mtime=%lld.%09ld",
+				(long long)statbuf.st_mtim.tv_sec, statbuf.st_mtim.tv_nsec);
+		keys[nkeys++] = mtime;
+	}
+	if (trashent->size >= 0) {
+		sprintf(size, "X-Size=%lld", job->newsize);
+		keys[nkeys++] = size;
+	}
+	/* the entries are locked on an fd of its own, the threads share trash->infofd */
+	int lockfd = openat(trash->infofd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (lockfd < 0)
+		die("open:");
+	if (flock(lockfd, LOCK_SH) < 0)
+		die("flock:");
+
+	if (setinfokeys(trash, trashent->infofilename, keys, nkeys) < 0) {
+		close(lockfd);
+		unlinkat(trash->stagingfd, tmpname, 0);
+		return;
+	}
+
+	if (renameat2(trash->stagingfd, tmpname, trash->filesfd, trashent->filesfilename,
+				RENAME_EXCHANGE) < 0) {
+		if (S_ISDIR(statbuf.st_mode) ||
+				renameat(trash->stagingfd, tmpname, trash->filesfd, trashent->filesfilename) < 0) {
+			close(lockfd);
+			warn("cannot replace '%s':", trashent->filesfilepath);
+			purgeat(trash, trash->stagingfd, tmpname);
+			return;
+		}
+	} else {
+		while (renamenoreplace(trash->stagingfd, tmpname, trash->expungedfd, tmpname) < 0) {
+			if (errno != EEXIST)
+				die("rename: cannot remove '%s/staging/%s':", trash->trashdirpath, tmpname);
+			purgeat(trash, trash->expungedfd, tmpname);
+		}
+	}
+
+	/* a summary built after the swap has the new size already */
+	if (faccessat(trash->trashfd, "summary", F_OK, 0) == 0) {
+		int sumfd = openat(trash->trashfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (sumfd < 0)
+			die("open:");
+		const char *deletedfilepath = getdeletedfilepath(trashent);
+		struct summarychange changes[] = {
+			{ trashent->deletiontime, job->oldsize, deletedfilepath, -1 },
+			{ trashent->deletiontime, job->newsize, deletedfilepath, 1 },
+		};
+		changesummary(trash->trashfd, sumfd, changes, 2);
+		close(sumfd);
+	}
+	if (close(lockfd) < 0)
+		die("close:");
+
+	trashent->compressed = compressed;
+	job->done = 1;
+}
+
+static void *
+compressents(void *arg)
+{
+	struct compression *compression = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&compression->next, 1, __ATOMIC_RELAXED)) < compression->len)
+		compressent(compression->trash, &compression->jobs[i]);
+
+	return NULL;
+}
+
+/*
+ * Compress the files of the entries deleted more than age seconds ago
+ * with gzip, on all processors at once, and report the space saved.
+ * Directories are archived with tar first.  restoretrashent() decompresses
+ * them again.  Entries that don't get smaller are marked so they aren't
+ * tried again.
+ */
+void
+trashcompress(Trash *trash, time_t age)
 {
 	asserttrash(trash);
 
+	purgeexpunged(trash);
+	opentrashsubdir(trash, "expunged", &trash->expungedfd, 1);
+	opentrashsubdir(trash, "staging", &trash->stagingfd, 1);
 	rewindtrash(trash);
 
+	struct compression compression = { trash, NULL, 0, 0 };
+	time_t before = time(NULL) - age;
+	size_t cap = 0;
+
 	struct trashent *trashent;
-	while ((trashent = readTrash(trash)) != NULL)
-		deletetrashent(trashent);
+	while ((trashent = readTrash(trash)) != NULL) {
+		if (trashent->deletiontime > before || trashent->compressed != PLAIN) {
+			freetrashent(trashent);
+			continue;
+		}
+
+		if (compression.len == cap) {
+			cap = cap ? 2 * cap : 64;
+			compression.jobs = realloc(compression.jobs, cap * sizeof(*compression.jobs));
+			if (!compression.jobs)
+				die("realloc:");
+		}
+		compression.jobs[compression.len++] = (struct compressjob){ trashent, 0, 0, 0, 0, 0 };
+	}
+
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	if ((size_t)nthreads > compression.len)
+		nthreads = compression.len;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_t threads[nthreads + 1];
+	for (long i = 1; i < nthreads; i++)
+		if ((errno = pthread_create(&threads[i], NULL, compressents, &compression)) != 0)
+			die("pthread_create:");
+	compressents(&compression);
+	for (long i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	size_t ncompressed = 0;
+	long long in = 0, saved = 0;
+	for (size_t i = 0; i < compression.len; i++) {
+		struct compressjob *job = &compression.jobs[i];
+
+		if (job->done) {
+			ncompressed++;
+			in += job->in;
+			saved += job->oldsize - job->newsize;
+		}
+		freetrashent(job->trashent);
+	}
+	free(compression.jobs);
+
+	purgeexpunged(trash);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("compressed %zu of %zu entries, %lld bytes saved, %.1f MB/s\n",
+			ncompressed, compression.len, saved,
+			seconds > 0 ? in / seconds / 1e6 : 0.0);
+}
+
+/*
+ * Return whether the file name trashent was deleted as is pattern.  The
+ * last component of its Path key is compared as it's decoded, so entries
+ * that don't match are never decoded.  Encoding the pattern instead
+ * wouldn't do, other implementations escape different characters and use
+ * lowercase hex digits.
+ */
+static int
+matchtrashent(struct trashent *trashent, const char *pattern)
+{
+	if (!trashent->encoded_deletedfilepath) {
+		char deletedfilepath_copy[strlen(trashent->deletedfilepath) + 1];
+		strcpy(deletedfilepath_copy, trashent->deletedfilepath);
+		return strcmp(basename(deletedfilepath_copy), pattern) == 0;
+	}
+
+	const char *path = trashent->encoded_deletedfilepath;
+	size_t end = strlen(path);
+	while (end > 1 && path[end - 1] == '/')
+		end--;
+	size_t start = end;
+	while (start > 0 && path[start - 1] != '/')
+		start--;
+	/* an escaped slash separates components once decoded */
+	for (size_t i = start; i + 3 <= end; i++)
+		if (path[i] == '%' && path[i + 1] == '2' && (path[i + 2] == 'F' || path[i + 2] == 'f'))
+			start = i + 3;
+
+	return uri_decodes_to(path + start, end - start, pattern);
 }
 
 void
@@ -487,16 +2866,13 @@ trashremove(Trash *trash, char *pattern)
 	asserttrash(trash);
 	assert(pattern != NULL);
 
+	purgeexpunged(trash);
 	rewindtrash(trash);
 
 	struct trashent *trashent;
 
 	while ((trashent = readTrash(trash)) != NULL) {
-		char deletedfilepath_copy[strlen(trashent->deletedfilepath) + 1];
-		strcpy(deletedfilepath_copy, trashent->deletedfilepath);
-		char *deletedfilename = basename(deletedfilepath_copy);
-
-		if (!strcmp(deletedfilename, pattern))
+		if (matchtrashent(trashent, pattern))
 			deletetrashent(trashent);
 
 		freetrashent(trashent);
@@ -514,14 +2890,9 @@ trashrestore(Trash *trash, char *pattern)
 	struct trashent *trashent;
 
 	while ((trashent = readTrash(trash))) {
-		char deletedfilepath_copy[strlen(trashent->deletedfilepath) + 1];
-		strcpy(deletedfilepath_copy, trashent->deletedfilepath);
-		char *deletedfilename = basename(deletedfilepath_copy);
-
 		int found = 0;
-		if (!strcmp(deletedfilename, pattern)) {
+		if (matchtrashent(trashent, pattern)) {
 			restoretrashent(trashent);
-			deletetrashent(trashent);
 			printf("restore: %s\n", trashent->deletedfilepath);
 
 			found = 1;
@@ -532,3 +2903,418 @@ trashrestore(Trash *trash, char *pattern)
 			break;
 	}
 }
+
+/*
+ * Write the entries whose file name matches one of the npatterns patterns,
+ * or all entries if there are none, to fd as a POSIX tar archive.  Each
+ * entry is stored as info/NAME.trashinfo followed by its manifest as
+ * checksums/NAME, if it has one, and files/NAME.
+ */
+void
+trashexport(Trash *trash, int fd, char **patterns, int npatterns)
+{
+	asserttrash(trash);
+
+	rewindtrash(trash);
+
+	struct trashent *trashent;
+	while ((trashent = readTrash(trash)) != NULL) {
+		int match = npatterns == 0;
+		for (int i = 0; i < npatterns && !match; i++)
+			match = matchtrashent(trashent, patterns[i]);
+
+		struct stat statbuf;
+		if (match && fstatat(trash->filesfd, trashent->filesfilename,
+					&statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+			warn("skipping '%s':", trashent->filesfilepath);
+			match = 0;
+		}
+
+		if (match) {
+			char infoname[strlen("info/") + strlen(trashent->infofilename) + 1];
+			char filesname[strlen("files/") + strlen(trashent->filesfilename) + 1];
+			sprintf(infoname, "info/%s", trashent->infofilename);
+			sprintf(filesname, "files/%s", trashent->filesfilename);
+
+			tarputfile(fd, infoname, trash->infofd, trashent->infofilename);
+			if (trashent->checksum == MANIFEST &&
+					opentrashsubdir(trash, "checksums", &trash->checksumsfd, 0) >= 0 &&
+					faccessat(trash->checksumsfd, trashent->filesfilename, F_OK,
+						AT_SYMLINK_NOFOLLOW) == 0) {
+				char manifestname[strlen("checksums/") + strlen(trashent->filesfilename) + 1];
+				sprintf(manifestname, "checksums/%s", trashent->filesfilename);
+				tarputfile(fd, manifestname, trash->checksumsfd, trashent->filesfilename);
+			}
+			size_t nlost = tarputfile(fd, filesname, trash->filesfd, trashent->filesfilename);
+			if (nlost)
+				warn("'%s': %zu special files or hardlinks not exported as they are",
+						trashent->filesfilepath, nlost);
+		}
+
+		freetrashent(trashent);
+	}
+
+	tarputend(fd);
+}
+
+/* Remove the line key from the info file in the *len bytes of buf. */
+static void
+dropinfoline(char *buf, size_t *len, const char *key)
+{
+	size_t keylen = strlen(key);
+
+	for (char *line = buf, *next; line < buf + *len; line = next) {
+		char *end = memchr(line, '\n', buf + *len - line);
+		next = end ? end + 1 : buf + *len;
+		if ((size_t)((end ? end : buf + *len) - line) != keylen ||
+				memcmp(line, key, keylen) != 0)
+			continue;
+
+		memmove(line, next, buf + *len - next);
+		*len -= next - line;
+		next = line;
+	}
+}
+
+/*
+ * Commit an imported entry once its file is extracted to stagename in
+ * $Trash/staging, like a put.  trashent has the name it had in the archive,
+ * info the contents of its info file there and manifest the name of its
+ * manifest in $Trash/staging, or NULL if it had none, and dirs the
+ * directories of its tree.  As on a put, the manifest is in place before
+ * the info file is marked as having one.  Entries with an invalid info
+ * file are dropped.
+ */
+static void
+finishimport(struct trashent *trashent, const char *stagename,
+		char *info, size_t infolen, const char *manifest, struct extracteddirs *dirs)
+{
+	Trash *trash = trashent->trash;
+
+	struct stat statbuf;
+	if (fstatat(trash->stagingfd, stagename, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+		warn("cannot import '%s': no file in the archive", trashent->filesfilename);
+		if (manifest)
+			unlinkat(trash->stagingfd, manifest, 0);
+		setdirs(-1, dirs);
+		return;
+	}
+
+	char *copy = xmalloc(infolen + 1);
+	memcpy(copy, info, infolen);
+	copy[infolen] = '\0';
+	struct infofile parsed;
+	int valid = parseinfo(copy, infolen, &parsed) == 0;
+	int hasmanifest = 0;
+	if (valid) {
+		valid = isdate(parsed.deletiondate);
+		hasmanifest = parsed.checksum == MANIFEST;
+		freeinfofile(&parsed);
+	}
+	free(copy);
+	if (!valid) {
+		warn("cannot import '%s': invalid info file", trashent->filesfilename);
+		purgeat(trash, trash->stagingfd, stagename);
+		if (manifest)
+			unlinkat(trash->stagingfd, manifest, 0);
+		setdirs(-1, dirs);
+		return;
+	}
+	if (hasmanifest) {
+		dropinfoline(info, &infolen, "X-Checksum=manifest");
+		if (!manifest)
+			warn("'%s' has no manifest in the archive, imported without",
+					trashent->filesfilename);
+	}
+
+	/* a directory without write permission can't be moved to another one */
+	int rootfd = -1;
+	if (dirs->len > 0 && (rootfd = openat(trash->stagingfd, stagename,
+					O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		die("open: cannot open '%s/staging/%s':", trash->trashdirpath, stagename);
+
+	int tmpfd = opentmpinfofile(trash, info, infolen);
+	lockentries(trash, LOCK_SH);
+	if (linkentry(trashent, &tmpfd, info, infolen, trash->stagingfd, stagename) < 0)
+		die("cannot import '%s':", trashent->filesfilename);
+	if (tmpfd >= 0 && close(tmpfd) < 0)
+		die("close:");
+	setdirs(rootfd, dirs);
+	if (rootfd >= 0)
+		close(rootfd);
+
+	if (hasmanifest && manifest) {
+		opentrashsubdir(trash, "checksums", &trash->checksumsfd, 1);
+		char *keys[] = { "X-Checksum=manifest" };
+		if (renameat(trash->stagingfd, manifest, trash->checksumsfd,
+					trashent->filesfilename) < 0)
+			warn("rename: cannot import manifest of '%s':", trashent->filesfilepath);
+		else
+			setinfokeys(trash, trashent->infofilename, keys, 1);
+	} else if (manifest) {
+		unlinkat(trash->stagingfd, manifest, 0);
+	}
+
+	struct trashent *imported = readinfofile(trash, trashent->infofilename);
+	if (imported) {
+		updatesummary(imported, trash->filesfd, imported->filesfilename, 1);
+		freetrashent(imported);
+	} else {
+		warn("imported invalid info file '%s'", trashent->infofilepath);
+	}
+	lockentries(trash, LOCK_UN);
+}
+
+/*
+ * Open the directory holding path in dirfd one component at a time, never
+ * following a symlink, and point *base at the last component of path.
+ * Return -1 if a component is a symlink or not a directory.
+ */
+static int
+openparent(int dirfd, const char *path, const char **base)
+{
+	int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		die("open:");
+
+	const char *p = path;
+	size_t len;
+	while (p[len = strcspn(p, "/")] == '/') {
+		char name[len + 1];
+		memcpy(name, p, len);
+		name[len] = '\0';
+
+		int subfd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		int err = errno;
+		close(fd);
+		if (subfd < 0) {
+			if (err == ELOOP || err == ENOTDIR)
+				return -1;
+			errno = err;
+			die("open: cannot open directory '%.*s':", (int)(p + len - path), path);
+		}
+		fd = subfd;
+		p += len + 1;
+	}
+	*base = p;
+
+	return fd;
+}
+
+/*
+ * Create the member described by hdr, whose data is next in fd, at path in
+ * dirfd.  Unsupported members, and members below a symlink an earlier one
+ * created, are skipped with a warning.  A directory is left writable, its
+ * mode and times are set by setdirs().
+ */
+static void
+extractmember(int dirfd, int fd, struct tarhdr *hdr, const char *path)
+{
+	const char *base;
+	int parentfd = openparent(dirfd, path, &base);
+	if (parentfd < 0) {
+		warn("skipping member '%s' below a symlink", hdr->name);
+		tarskipdata(fd, hdr->size);
+		return;
+	}
+
+	if (hdr->type == '5') {
+		if (mkdirat(parentfd, base, (hdr->mode & 07777) | S_IRWXU) < 0 &&
+				errno != EEXIST)
+			die("mkdir: cannot create '%s':", path);
+	} else if (hdr->type == '0' || hdr->type == '7') {
+		int outfd = openat(parentfd, base,
+				O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+				hdr->mode & 07777);
+		if (outfd < 0)
+			die("open: cannot create '%s':", path);
+		tarcopydata(fd, outfd, hdr->size);
+		struct timespec times[2] = { { 0, UTIME_OMIT }, hdr->mtime };
+		if (fchmod(outfd, hdr->mode & 07777) < 0 || futimens(outfd, times) < 0)
+			warn("cannot set mode and times of '%s':", path);
+		if (close(outfd) < 0)
+			die("close:");
+	} else if (hdr->type == '2') {
+		if (symlinkat(hdr->linkname, parentfd, base) < 0)
+			die("symlink: cannot create '%s':", path);
+		struct timespec times[2] = { { 0, UTIME_OMIT }, hdr->mtime };
+		utimensat(parentfd, base, times, AT_SYMLINK_NOFOLLOW);
+	} else {
+		warn("skipping unsupported member '%s'", hdr->name);
+		tarskipdata(fd, hdr->size);
+	}
+
+	close(parentfd);
+}
+
+/*
+ * Add the directory member hdr to dirs, if it's one, at rest, its path
+ * below the top of the tree with a leading slash, or "" for the top.
+ */
+static void
+adddir(struct extracteddirs *dirs, const char *rest, struct tarhdr *hdr)
+{
+	if (hdr->type != '5')
+		return;
+
+	dirs->dirs = realloc(dirs->dirs, (dirs->len + 1) * sizeof(*dirs->dirs));
+	if (!dirs->dirs)
+		die("realloc:");
+
+	struct extracteddir *dir = &dirs->dirs[dirs->len++];
+	size_t len = strlen(rest);
+	if (len > 0 && rest[len - 1] == '/')
+		len--;
+	if (len <= 1) {
+		dir->path = xmalloc(2);
+		strcpy(dir->path, ".");
+	} else {
+		dir->path = xmalloc(len);
+		memcpy(dir->path, rest + 1, len - 1);
+		dir->path[len - 1] = '\0';
+	}
+	dir->mode = hdr->mode & 07777;
+	dir->mtime = hdr->mtime;
+}
+
+/*
+ * Set the modes and modification times of the directories in dirs, in the
+ * tree open on rootfd, and free them.  An archive has a directory before
+ * its members, so going backwards sets them deepest first and a directory
+ * is never closed to its subdirectories too early.  With rootfd -1 they're
+ * only freed.
+ */
+static void
+setdirs(int rootfd, struct extracteddirs *dirs)
+{
+	while (dirs->len > 0) {
+		struct extracteddir *dir = &dirs->dirs[--dirs->len];
+		const char *base;
+		int parentfd = rootfd < 0 ? -1 : openparent(rootfd, dir->path, &base);
+		int fd = parentfd < 0 ? -1 : openat(parentfd, base,
+				O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+		if (fd >= 0) {
+			struct timespec times[2] = { { 0, UTIME_OMIT }, dir->mtime };
+			if (fchmod(fd, dir->mode) < 0 || futimens(fd, times) < 0)
+				warn("cannot set mode and times of '%s':", dir->path);
+			close(fd);
+		}
+		if (parentfd >= 0)
+			close(parentfd);
+		free(dir->path);
+	}
+
+	free(dirs->dirs);
+	dirs->dirs = NULL;
+}
+
+/* Return whether path has no empty, "." or ".." components. */
+static int
+issafepath(const char *path)
+{
+	for (const char *p = path; *p; ) {
+		size_t len = strcspn(p, "/");
+		if (len == 0 || (len == 1 && p[0] == '.') ||
+				(len == 2 && p[0] == '.' && p[1] == '.'))
+			return 0;
+		p += len;
+		if (*p == '/' && *++p == '\0')
+			break;
+	}
+
+	return *path != '\0';
+}
+
+/*
+ * Add the entries in the tar archive read from fd, as written by
+ * trashexport(), to trash.  An entry whose name is taken gets a "_N"
+ * suffix.  Its file is extracted to $Trash/staging and committed like a
+ * put, so an interrupted import never leaves an entry with a partial file.
+ */
+void
+trashimport(Trash *trash, int fd)
+{
+	asserttrash(trash);
+
+	struct tarhdr hdr;
+	struct trashent *trashent = NULL;
+	char *oldname = NULL;
+	char *info = NULL;
+	size_t infolen = 0;
+	char stagename[STAGENAMELEN];
+	char manifest[STAGENAMELEN];
+	int hasmanifest = 0;
+	struct extracteddirs dirs = { NULL, 0 };
+
+	while (targetheader(fd, &hdr)) {
+		const char *rest;
+
+		if (strncmp(hdr.name, "info/", strlen("info/")) == 0 &&
+				strendswith(hdr.name, ".trashinfo") &&
+				!strchr(hdr.name + strlen("info/"), '/')) {
+			if (trashent) {
+				finishimport(trashent, stagename, info, infolen,
+						hasmanifest ? manifest : NULL, &dirs);
+				freetrashent(trashent);
+				free(info);
+				free(oldname);
+			}
+
+			if (hdr.size > 1 << 20)
+				die("cannot import '%s': info file too large", hdr.name);
+			infolen = hdr.size;
+			info = xmalloc(infolen + 1);
+			tarreaddata(fd, info, infolen);
+
+			size_t namelen = strlen(hdr.name) - strlen("info/") - strlen(".trashinfo");
+			oldname = xmalloc(namelen + 1);
+			memcpy(oldname, hdr.name + strlen("info/"), namelen);
+			oldname[namelen] = '\0';
+			if (!issafepath(oldname))
+				die("cannot import '%s': invalid name", hdr.name);
+
+			trashent = createtrashent(trash, oldname, -1);
+			stage(trash, stagename);
+			hasmanifest = 0;
+		} else if (trashent && !hasmanifest && hdr.type == '0' &&
+				strncmp(hdr.name, "checksums/", strlen("checksums/")) == 0 &&
+				strcmp(hdr.name + strlen("checksums/"), oldname) == 0) {
+			stage(trash, manifest);
+			int outfd = openat(trash->stagingfd, manifest,
+					O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+			if (outfd < 0)
+				die("open: cannot create '%s/staging/%s':", trash->trashdirpath, manifest);
+			tarcopydata(fd, outfd, hdr.size);
+			if (close(outfd) < 0)
+				die("close:");
+			hasmanifest = 1;
+		} else if (trashent &&
+				strncmp(hdr.name, "files/", strlen("files/")) == 0 &&
+				strncmp((rest = hdr.name + strlen("files/")), oldname, strlen(oldname)) == 0 &&
+				(rest[strlen(oldname)] == '\0' || rest[strlen(oldname)] == '/') &&
+				issafepath(rest)) {
+			rest += strlen(oldname);
+			char path[strlen(stagename) + strlen(rest) + 1];
+			sprintf(path, "%s%s", stagename, rest);
+			if (path[strlen(path) - 1] == '/')
+				path[strlen(path) - 1] = '\0';
+
+			extractmember(trash->stagingfd, fd, &hdr, path);
+			adddir(&dirs, rest, &hdr);
+		} else {
+			warn("skipping unknown member '%s'", hdr.name);
+			tarskipdata(fd, hdr.size);
+		}
+
+		freetarhdr(&hdr);
+	}
+
+	if (trashent) {
+		finishimport(trashent, stagename, info, infolen,
+				hasmanifest ? manifest : NULL, &dirs);
+		freetrashent(trashent);
+		free(info);
+		free(oldname);
+	}
+}
@@ -4,10 +4,20 @@ typedef struct trash Trash;
 
 Trash *opentrash(const char *);
 void closetrash(Trash *);
+void trashthrottle(Trash *, unsigned long long, unsigned long);
+void trashsetdedup(Trash *, int);
+void trashsetchecksum(Trash *, int);
+void trashsetverify(Trash *, int);
 
 int trashput(Trash *, const char *);
 void trashlist(Trash *);
+size_t trashcheck(Trash *, int);
+void trashmetrics(Trash **, size_t);
 void trashclean(Trash *);
+void trashdedup(Trash *);
+void trashcompress(Trash *, time_t);
 void trashremove(Trash *, char *);
 void trashrestore(Trash *, char *);
+void trashexport(Trash *, int, char **, int);
+void trashimport(Trash *, int);
 #endif
@@ -1,11 +1,13 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "trash.h"
 #include "util.h"
 
-char *arguments = "[-h]";
+char *arguments = "[-hV] PATTERN | -I FILE";
 
 void
 show_help(char *program_name)
@@ -20,19 +22,44 @@ main(int argc, char *argv[])
 	if (argc < 2)
 		show_help(argv[0]);
 
+	char *import = NULL;
+	int verify = 0;
+
 	int opt;
-	while ((opt = getopt(argc, argv, "h")) != -1) {
+	while ((opt = getopt(argc, argv, "hVI:")) != -1) {
 		switch (opt) {
 		case 'h':
 			show_help(argv[0]);
 			break;
+		case 'V':
+			verify = 1;
+			break;
+		case 'I':
+			import = optarg;
+			break;
 		case '?':
 			show_help(argv[0]);
 		}
 	}
 
+	if (!import && optind >= argc)
+		show_help(argv[0]);
+
 	Trash *trash = opentrash(NULL);
-	trashrestore(trash, argv[1]);
+	trashsetverify(trash, verify);
+	if (import) {
+		int fd = STDIN_FILENO;
+		if (strcmp(import, "-") != 0 &&
+				(fd = open(import, O_RDONLY | O_CLOEXEC)) < 0)
+			die("open: cannot open '%s':", import);
+
+		trashimport(trash, fd);
+
+		if (close(fd) < 0)
+			die("close:");
+	} else {
+		trashrestore(trash, argv[optind]);
+	}
 	closetrash(trash);
 
 	return EXIT_SUCCESS;
@@ -1,31 +1,53 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "util.h"
 
-void
-die(const char *fmt, ...)
+static void
+vwarn(const char *fmt, va_list ap)
 {
 	int errnocpy = errno;
-	va_list ap;
 
-	va_start(ap, fmt);
 	vfprintf(stderr, fmt, ap);
-	va_end(ap);
 
 	if (fmt[0] && fmt[strlen(fmt) - 1] == ':') {
 		fputc(' ', stderr);
 		fprintf(stderr, "%s\n", strerror(errnocpy));
 	} else
 		fputc('\n', stderr);
+}
+
+void
+warn(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vwarn(fmt, ap);
+	va_end(ap);
+}
+
+void
+die(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vwarn(fmt, ap);
+	va_end(ap);
 
 	exit(EXIT_FAILURE);
 }
@@ -77,6 +99,107 @@ xmkdir(char *path)
 		die("mkdir '%s':", path);
 }
 
+/* write all of buf to fd, retrying short writes */
+ssize_t
+xwrite(int fd, const void *buf, size_t count)
+{
+	const char *p = buf;
+	size_t left = count;
+
+	while (left > 0) {
+		ssize_t n = write(fd, p, left);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		left -= n;
+	}
+
+	return count;
+}
+
+/*
+ * Like renameat but fail with EEXIST instead of replacing newpath.
+ * Falls back to a racy check on file systems without RENAME_NOREPLACE.
+ */
+int
+renamenoreplace(int olddirfd, const char *oldpath, int newdirfd, const char *newpath)
+{
+	if (renameat2(olddirfd, oldpath, newdirfd, newpath, RENAME_NOREPLACE) == 0)
+		return 0;
+	if (errno != EINVAL && errno != ENOSYS)
+		return -1;
+
+	struct stat sb;
+	if (fstatat(newdirfd, newpath, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	return renameat(olddirfd, oldpath, newdirfd, newpath);
+}
+
+/*
+ * Read the names in dirfd, except "." and "..", into list with large
+ * getdents64 calls.  The names are stored back to back in list->buf.
+ */
+void
+listdir(int dirfd, struct dirlist *list)
+{
+	int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		die("open:");
+
+	size_t dentslen = 1 << 20;
+	char *dents = xmalloc(dentslen);
+	size_t cap = 1 << 20, len = 0;
+	char *buf = xmalloc(cap);
+	size_t n = 0;
+
+	ssize_t nread;
+	while ((nread = getdents64(fd, dents, dentslen)) > 0) {
+		for (ssize_t off = 0; off < nread; ) {
+			struct dirent64 *dp = (struct dirent64 *)(dents + off);
+			off += dp->d_reclen;
+
+			if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+				continue;
+
+			size_t namelen = strlen(dp->d_name) + 1;
+			if (len + namelen > cap) {
+				cap *= 2;
+				if (!(buf = realloc(buf, cap)))
+					die("realloc:");
+			}
+			memcpy(buf + len, dp->d_name, namelen);
+			len += namelen;
+			n++;
+		}
+	}
+	if (nread < 0)
+		die("getdents64:");
+	close(fd);
+	free(dents);
+
+	list->buf = buf;
+	list->len = n;
+	list->names = xmalloc((n + 1) * sizeof(*list->names));
+	for (size_t i = 0, off = 0; i < n; i++) {
+		list->names[i] = buf + off;
+		off += strlen(buf + off) + 1;
+	}
+	list->names[n] = NULL;
+}
+
+void
+freedirlist(struct dirlist *list)
+{
+	free(list->names);
+	free(list->buf);
+}
+
 int
 file_exists(const char *file)
 {
@@ -84,35 +207,128 @@ file_exists(const char *file)
 	return lstat(file, &sb) == 0;
 }
 
-void
-remove_directory(const char *path)
+/*
+ * Parse a size such as "200MB/s" or "4k", suffixes are powers of 1024
+ * and a trailing "B", "iB" or "/s" is accepted.  Return -1 on error.
+ */
+int
+parsesize(const char *str, unsigned long long *size)
+{
+	char *end;
+
+	errno = 0;
+	unsigned long long n = strtoull(str, &end, 10);
+	if (end == str || errno != 0)
+		return -1;
+
+	const char *units = "KMGT";
+	const char *unit = *end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+	if (unit) {
+		for (const char *u = units; u <= unit; u++) {
+			if (n > ~0ULL / 1024)
+				return -1;
+			n *= 1024;
+		}
+		end++;
+		if (*end == 'i')
+			end++;
+	}
+	if (*end == 'B' || *end == 'b')
+		end++;
+	if (strcmp(end, "/s") != 0 && *end != '\0')
+		return -1;
+
+	*size = n;
+	return 0;
+}
+
+/*
+ * Parse a duration such as "90s", "12h" or "7d" into seconds, a number
+ * without a unit is in days.  Return -1 if str isn't one.
+ */
+int
+parseduration(const char *str, time_t *seconds)
 {
-	DIR *dirp = opendir(path);
-	if (!dirp)
-		die("opendir:");
+	char *end;
 
-	size_t pathlen = strlen(path);
-	struct dirent *dp;
-	char buf[PATH_MAX];
 	errno = 0;
-	while ((dp = readdir(dirp)) != NULL) {
-		if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
-			continue;
-
-		size_t len = pathlen + 1 + strlen(dp->d_name);
-		snprintf(buf, len + 1, "%s/%s", path, dp->d_name);
-
-		struct stat statbuf;
-		if (lstat(buf, &statbuf) < 0)
-			die("lstat:");
-		if (S_ISDIR(statbuf.st_mode))
-			remove_directory(buf);
-		else
-			unlink(buf);
+	long long n = strtoll(str, &end, 10);
+	if (end == str || errno != 0 || n < 0)
+		return -1;
+
+	long long unit;
+	switch (*end) {
+	case 's': unit = 1; break;
+	case 'm': unit = 60; break;
+	case 'h': unit = 3600; break;
+	case '\0':
+	case 'd': unit = 86400; break;
+	case 'w': unit = 7 * 86400; break;
+	default: return -1;
 	}
+	if (*end && end[1] != '\0')
+		return -1;
+	if (n > LLONG_MAX / unit)
+		return -1;
 
-	closedir(dirp);
-	rmdir(path);
+	*seconds = n * unit;
+	return 0;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a bucket of rate tokens per second holding at most a tenth of a second */
+void
+bucketinit(struct bucket *bucket, double rate)
+{
+	bucket->rate = rate;
+	bucket->tokens = rate / 10;
+	bucket->last = now();
+}
+
+/*
+ * Take n tokens, sleeping until the bucket has refilled enough.
+ * Does nothing for a bucket with a rate of 0.
+ */
+void
+bucketwait(struct bucket *bucket, double n)
+{
+	if (bucket->rate <= 0)
+		return;
+
+	double t = now();
+	bucket->tokens += (t - bucket->last) * bucket->rate;
+	if (bucket->tokens > bucket->rate / 10)
+		bucket->tokens = bucket->rate / 10;
+	bucket->last = t;
+
+	bucket->tokens -= n;
+	if (bucket->tokens < 0) {
+		double wait = -bucket->tokens / bucket->rate;
+		struct timespec ts = { wait, (wait - (long)wait) * 1e9 };
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+	}
+}
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+/* only do I/O when no other process needs the disk */
+void
+idleioprio(void)
+{
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+				IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+		die("ioprio_set:");
 }
 
 char *
@@ -146,6 +362,28 @@ uri_decode(const char *encoded_str)
 	return str;
 }
 
+/*
+ * Return whether the first len bytes of encoded_str decode to str, the
+ * way uri_decode() would decode them, without decoding them first.
+ */
+int
+uri_decodes_to(const char *encoded_str, size_t len, const char *str)
+{
+	for (size_t i = 0; i < len; str++) {
+		unsigned char c = encoded_str[i++];
+		if (c == '%') {
+			char buf[3] = { 0 };
+			for (int j = 0; j < 2 && i < len; j++)
+				buf[j] = encoded_str[i++];
+			c = strtol(buf, NULL, 16);
+		}
+		if (*str == '\0' || (unsigned char)*str != c)
+			return 0;
+	}
+
+	return *str == '\0';
+}
+
 char *
 uri_encode(const char *str)
 {
@@ -165,7 +403,7 @@ uri_encode(const char *str)
 		) {
 			encoded_str[pos++] = str[i];
 		} else {
-			pos += sprintf(encoded_str + pos, "%%%X", (unsigned char)str[i]);
+			pos += sprintf(encoded_str + pos, "%%%02X", (unsigned char)str[i]);
 		}
 	}
 	encoded_str[pos] = '\0';
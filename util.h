@@ -1,5 +1,18 @@
 #ifndef UTIL_H
 #define UTIL_H
+struct bucket {
+	double rate;
+	double tokens;
+	double last;
+};
+
+struct dirlist {
+	char **names;
+	size_t len;
+	char *buf;
+};
+
+void warn(const char *fmt, ...);
 void die(const char *fmt, ...);
 
 void *xmalloc(size_t size);
@@ -10,12 +23,24 @@ int strendswith(const char *str, const char *suffix);
 
 void xmkdir(char *path);
 
+ssize_t xwrite(int fd, const void *buf, size_t count);
+int renamenoreplace(int olddirfd, const char *oldpath, int newdirfd, const char *newpath);
+
+void listdir(int dirfd, struct dirlist *list);
+void freedirlist(struct dirlist *list);
+
 int file_exists(const char *file);
-void remove_directory(const char *path);
 
+int parsesize(const char *str, unsigned long long *size);
+int parseduration(const char *str, time_t *seconds);
+
+void bucketinit(struct bucket *bucket, double rate);
+void bucketwait(struct bucket *bucket, double n);
+void idleioprio(void);
 
 char * uri_encode(const char* originalText);
 char * uri_decode(const char* encodedText);
+int uri_decodes_to(const char *encoded_str, size_t len, const char *str);
 char * fullpath_encode(char *path);
 char * fullpath_decode(char *path);
 #endif